@@ -1,4 +1,15 @@
 #include <algorithm>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <immintrin.h>
 
 #include "bloom.hpp"
 #include "murmurhash/MurmurHash3.h"
@@ -6,6 +17,341 @@
 namespace lvldb
 {
 
+namespace
+{
+
+__extension__ typedef unsigned __int128 uint128_t;
+
+// Ref: Daniel Lemire
+//      A fast alternative to the modulo reduction
+//
+// Maps a hash to [0, range) with a multiplication instead of a division
+inline uint64_t reduce(uint64_t hash, uint64_t range)
+{
+	return static_cast<uint128_t>(hash) * range >> 64;
+}
+
+size_t popcount_words(const uint64_t *words, size_t size)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < size; i++)
+		count += __builtin_popcountll(words[i]);
+
+	return count;
+}
+
+// Same loop, built for the popcnt instruction instead of a libgcc call
+__attribute__((target("popcnt")))
+size_t popcount_words_popcnt(const uint64_t *words, size_t size)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < size; i++)
+		count += __builtin_popcountll(words[i]);
+
+	return count;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+size_t popcount_words_avx512(const uint64_t *words, size_t size)
+{
+	__m512i  counts = _mm512_setzero_si512();
+	uint64_t lanes[8];
+	size_t   count  = 0;
+	size_t   i      = 0;
+
+	for (; i + 8 <= size; i += 8)
+		counts = _mm512_add_epi64(counts, _mm512_popcnt_epi64(_mm512_loadu_si512(&words[i])));
+
+	// _mm512_reduce_add_epi64() warns about its own undefined lanes with
+	// GCC 12 at -O2
+	_mm512_storeu_si512(lanes, counts);
+
+	for (uint64_t lane : lanes)
+		count += lane;
+
+	return count + popcount_words_popcnt(&words[i], size - i);
+}
+
+// Bits set in the words, with the fastest instructions the CPU has
+size_t popcount(const uint64_t *words, size_t size)
+{
+	static const bool avx512 = __builtin_cpu_supports("avx512vpopcntdq");
+	static const bool popcnt = __builtin_cpu_supports("popcnt");
+
+	if (avx512)
+		return popcount_words_avx512(words, size);
+	else if (popcnt)
+		return popcount_words_popcnt(words, size);
+	else
+		return popcount_words(words, size);
+}
+
+bloom_simd_t cpu_simd()
+{
+	static const bloom_simd_t simd = __builtin_cpu_supports("avx512f") ? bloom_simd_avx512 :
+					 __builtin_cpu_supports("avx2") ? bloom_simd_avx2 :
+					 bloom_simd_none;
+
+	return simd;
+}
+
+// Zeroed and aligned to a cache line, as blocks need
+bloom_words_t allocate_words(size_t size)
+{
+	void *words;
+
+	if (posix_memalign(&words, 64, size * sizeof(uint64_t)) != 0) {
+		perror("posix_memalign");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(words, 0, size * sizeof(uint64_t));
+
+	return bloom_words_t(static_cast<uint64_t *>(words));
+}
+
+// File format, in host byte order: a header of a cache line, so mapped
+// blocks stay aligned, then the words of the filter. The checksum of
+// the header covers every field before it.
+const char     file_magic[8] = {'L', 'V', 'L', 'B', 'L', 'O', 'O', 'M'};
+const uint32_t file_version  = 1;
+
+// MurmurHash3_x64_128 of the keys and its seed, then Kirsch and
+// Mitzenmacher double hashing reduced by multiply-shift
+const uint32_t scheme_standard = 1;
+// Same hash, the first half picks a 512 bit block by multiply-shift and
+// the second one sets bits in it with an odd step
+const uint32_t scheme_blocked  = 2;
+
+struct file_header_t
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t scheme;
+	uint64_t num_hashes;
+	uint64_t num_words;
+	uint32_t seed;
+	uint32_t padding;
+	uint64_t words_checksum;
+	uint64_t header_checksum;
+	char     reserved[8];
+};
+
+static_assert(sizeof(file_header_t) == 64, "file header is a cache line");
+
+// MurmurHash3 takes int lengths, so large arrays go in chunks
+uint64_t checksum(const void *data, size_t size)
+{
+	const size_t  chunk_size = 1 << 30;
+	const char   *bytes      = static_cast<const char *>(data);
+	uint64_t      sum        = size;
+
+	for (size_t i = 0; i < size; i += chunk_size) {
+		uint64_t hash[2];
+
+		MurmurHash3_x64_128(bytes + i, std::min(chunk_size, size - i), i / chunk_size, hash);
+		sum = (sum ^ hash[0]) * 0x9e3779b97f4a7c15 + hash[1];
+	}
+
+	return sum;
+}
+
+void write_all(int fd, const void *data, size_t size)
+{
+	const char *bytes = static_cast<const char *>(data);
+
+	while (size > 0) {
+		ssize_t written = write(fd, bytes, size);
+
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+
+		bytes += written;
+		size  -= written;
+	}
+}
+
+// Checksums size bytes of fd from offset as written, not as they are in
+// memory now
+uint64_t checksum_file(int fd, off_t offset, size_t size)
+{
+	void     *mapping = mmap(nullptr, offset + size, PROT_READ, MAP_SHARED, fd, 0);
+	uint64_t  sum;
+
+	if (mapping == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	sum = checksum(static_cast<const char *>(mapping) + offset, size);
+	munmap(mapping, offset + size);
+
+	return sum;
+}
+
+// Makes a rename into the directory of path survive a crash
+void sync_directory(const char *path)
+{
+	std::string dir   = path;
+	size_t      slash = dir.rfind('/');
+	int         fd;
+
+	if (slash == std::string::npos)
+		dir = ".";
+	else
+		dir.resize(slash == 0 ? 1 : slash);
+
+	if ((fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY)) == -1 || fsync(fd) == -1) {
+		perror("fsync");
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+}
+
+// Writes a temporary file next to path and renames it, so path always
+// holds a whole filter. The words may change under insert_atomic()
+// while being written, so they are checksummed from the file.
+void save_words(const char *path, uint32_t scheme, size_t num_hashes,
+		uint32_t seed, const uint64_t *words, size_t num_words)
+{
+	std::string   temp = std::string(path) + ".XXXXXX";
+	file_header_t header;
+	int           fd;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, file_magic, sizeof(file_magic));
+	header.version    = file_version;
+	header.scheme     = scheme;
+	header.num_hashes = num_hashes;
+	header.num_words  = num_words;
+	header.seed       = seed;
+
+	if ((fd = mkstemp(&temp[0])) == -1) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+
+	// mkstemp() makes it private to the owner
+	if (fchmod(fd, 0644) == -1) {
+		perror("fchmod");
+		exit(EXIT_FAILURE);
+	}
+
+	// The header goes first with no checksums and is rewritten once the
+	// words are in
+	write_all(fd, &header, sizeof(header));
+	write_all(fd, words, num_words * sizeof(uint64_t));
+
+	header.words_checksum  = checksum_file(fd, sizeof(header), num_words * sizeof(uint64_t));
+	header.header_checksum = checksum(&header, offsetof(file_header_t, header_checksum));
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		perror("lseek");
+		exit(EXIT_FAILURE);
+	}
+
+	write_all(fd, &header, sizeof(header));
+
+	if (fsync(fd) == -1 || close(fd) == -1) {
+		perror("fsync");
+		exit(EXIT_FAILURE);
+	}
+
+	if (rename(temp.c_str(), path) == -1) {
+		perror("rename");
+		exit(EXIT_FAILURE);
+	}
+
+	sync_directory(path);
+}
+
+// Maps a file saved with save_words() read only, the words are null if
+// it is missing or not a valid filter of the scheme
+bloom_words_t load_words(const char *path, uint32_t scheme, bool check_words,
+			 file_header_t &header)
+{
+	struct stat  st;
+	void        *mapping;
+	int          fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno == ENOENT)
+			return nullptr;
+
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+
+	if (static_cast<size_t>(st.st_size) < sizeof(header)) {
+		close(fd);
+		return nullptr;
+	}
+
+	mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (mapping == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+
+	// Probes go all over the filter, read ahead would be wasted
+	if (madvise(mapping, st.st_size, MADV_RANDOM) == -1) {
+		perror("madvise");
+		exit(EXIT_FAILURE);
+	}
+
+	bloom_words_deleter_t  deleter;
+	const uint64_t        *words = reinterpret_cast<const uint64_t *>(
+					static_cast<const char *>(mapping) + sizeof(header));
+
+	deleter.mapping = mapping;
+	deleter.size    = st.st_size;
+	memcpy(&header, mapping, sizeof(header));
+
+	bloom_words_t loaded(const_cast<uint64_t *>(words), deleter);
+
+	if (memcmp(header.magic, file_magic, sizeof(file_magic)) != 0 ||
+	    header.header_checksum != checksum(&header, offsetof(file_header_t, header_checksum)) ||
+	    header.version != file_version || header.scheme != scheme ||
+	    header.num_hashes == 0 || header.num_words == 0 ||
+	    header.num_words != (st.st_size - sizeof(header)) / sizeof(uint64_t) ||
+	    (st.st_size - sizeof(header)) % sizeof(uint64_t) != 0)
+		return nullptr;
+
+	if (check_words &&
+	    header.words_checksum != checksum(words, header.num_words * sizeof(uint64_t)))
+		return nullptr;
+
+	return loaded;
+}
+
+}
+
+void bloom_words_deleter_t::operator()(uint64_t *words) const
+{
+	if (mapping != nullptr)
+		munmap(mapping, size);
+	else
+		free(words);
+}
+
+const size_t bloom_filter_t::max_hashes;
+
 bloom_filter_t::bloom_filter_t(size_t num_keys, double error_rate)
 {
 	auto filter = calculate_filter(num_keys, error_rate);
@@ -13,44 +359,91 @@ bloom_filter_t::bloom_filter_t(size_t num_keys, double error_rate)
 	num_hashes_  = filter.first;
 	num_buckets_ = filter.second;
 
-	indexes_ = std::unique_ptr<size_t[]>(new size_t[num_hashes_]);
-	buckets_ = std::unique_ptr<uint8_t[]>(new uint8_t[num_buckets_ / 8]);
+	buckets_ = allocate_words(num_buckets_ / 64);
 }
 
+bloom_filter_t::bloom_filter_t(size_t num_hashes, size_t num_buckets, bloom_words_t buckets):
+	num_hashes_(num_hashes),
+	num_buckets_(num_buckets),
+	buckets_(std::move(buckets))
+{ }
+
 void bloom_filter_t::insert(const void *key, size_t len)
 {
-	generate_indexes(key, len);
+	uint64_t hash[2];
+
+	assert(buckets_.get_deleter().mapping == nullptr);
+
+	this->hash(key, len, hash);
 	for (size_t i = 0; i < num_hashes_; i++)
-		set_bit(indexes_[i]);
+		set_bit(index(hash, i));
 }
 
+void bloom_filter_t::insert_atomic(const void *key, size_t len)
+{
+	uint64_t hash[2];
+
+	assert(buckets_.get_deleter().mapping == nullptr);
+
+	this->hash(key, len, hash);
+	for (size_t i = 0; i < num_hashes_; i++)
+		set_bit_atomic(index(hash, i));
+}
+
+// Indexes are computed as they are probed, so nothing is shared
 bool bloom_filter_t::member(const void *key, size_t len) const
 {
-	generate_indexes(key, len);
+	uint64_t hash[2];
+
+	this->hash(key, len, hash);
 	for (size_t i = 0; i < num_hashes_; i++) {
-		if (get_bit(indexes_[i]) == 0)
+		if (get_bit(index(hash, i)) == 0)
 			return false;
 	}
 
 	return true;
 }
 
+void bloom_filter_t::member_batch(const void *const keys[], const size_t lens[],
+				  size_t count, bool results[], bloom_simd_t simd) const
+{
+	if (std::min(simd, cpu_simd()) >= bloom_simd_avx2)
+		probe_batch<&bloom_filter_t::probe_avx2>(keys, lens, count, results);
+	else
+		probe_batch<&bloom_filter_t::probe>(keys, lens, count, results);
+}
+
 void bloom_filter_t::clear()
 {
-	std::fill_n(buckets_.get(), num_buckets_ / 8, 0);
+	assert(buckets_.get_deleter().mapping == nullptr);
+	std::fill_n(buckets_.get(), num_buckets_ / 64, 0);
 }
 
-// Ref: Brian Kernighan's population count
 size_t bloom_filter_t::count() const
 {
-	size_t count = 0;
+	return popcount(buckets_.get(), num_buckets_ / 64);
+}
 
-	for (size_t i = 0; i < num_buckets_ / 8; i++) {
-		for (uint8_t byte = buckets_[i]; byte; count++)
-			byte &= byte - 1;
-	}
+void bloom_filter_t::save(const char *path) const
+{
+	save_words(path, scheme_standard, num_hashes_, seed_, buckets_.get(), num_buckets_ / 64);
+}
 
-	return count;
+std::unique_ptr<const bloom_filter_t> bloom_filter_t::load(const char *path, bool check_bits)
+{
+	file_header_t                         header;
+	bloom_words_t                         buckets = load_words(path, scheme_standard, check_bits, header);
+	std::unique_ptr<const bloom_filter_t> filter;
+
+	if (buckets && header.num_hashes <= max_hashes)
+		filter.reset(new bloom_filter_t(header.num_hashes, header.num_words * 64,
+						std::move(buckets)));
+
+	// Keys would hash elsewhere with another seed
+	if (filter && filter->seed_ != header.seed)
+		filter.reset();
+
+	return filter;
 }
 
 std::ostream &operator<<(std::ostream &stream, const bloom_filter_t &filter)
@@ -71,33 +464,361 @@ std::pair<size_t, size_t> bloom_filter_t::calculate_filter(size_t num_keys, doub
 	double log2       = log(2);
 	size_t total_bits = -ceil(num_keys * log(error_rate) / (log2 * log2));
 
-	// Round to 8 for the byte array's size
-	total_bits = ceil(total_bits / 8.0) * 8;
+	// Round to 64 for the word array's size
+	total_bits = ceil(total_bits / 64.0) * 64;
 
-	size_t optimal_num_hashes = ceil(log2 * total_bits / num_keys);
+	size_t optimal_num_hashes = std::min<size_t>(ceil(log2 * total_bits / num_keys), max_hashes);
 
 	return {optimal_num_hashes, total_bits};
 }
 
+inline void bloom_filter_t::hash(const void *key, size_t len, uint64_t hash[2]) const
+{
+	MurmurHash3_x64_128(key, len, seed_, hash);
+}
+
 // Ref: Adam Kirsch and Michael Mitzenmacher
 //      Less Hashing, Same Performance: Building a Better Bloom Filter
-void bloom_filter_t::generate_indexes(const void *key, size_t len) const
+inline size_t bloom_filter_t::index(const uint64_t hash[2], size_t i) const
+{
+	return reduce(hash[0] + i * hash[1], num_buckets_);
+}
+
+inline bool bloom_filter_t::probe(const uint64_t indexes[]) const
+{
+	for (size_t i = 0; i < num_hashes_; i++) {
+		if (get_bit(indexes[i]) == 0)
+			return false;
+	}
+
+	return true;
+}
+
+// Gathers the words holding four bits at once
+__attribute__((target("avx2")))
+bool bloom_filter_t::probe_avx2(const uint64_t indexes[]) const
+{
+	const long long *words = reinterpret_cast<const long long *>(buckets_.get());
+
+	for (size_t i = 0; i < num_hashes_; i += 4) {
+		__m256i bits = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&indexes[i]));
+		__m256i word = _mm256_i64gather_epi64(words, _mm256_srli_epi64(bits, 6), 8);
+		__m256i set  = _mm256_and_si256(_mm256_srlv_epi64(word, _mm256_and_si256(bits, _mm256_set1_epi64x(63))),
+						_mm256_set1_epi64x(1));
+
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(set, _mm256_setzero_si256())) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+// Computes and prefetches the indexes of a whole batch before probing
+// it. Each key gets its indexes padded to a multiple of four with
+// repeats of its last one, for the vector probes.
+template<bool (bloom_filter_t::*Probe)(const uint64_t indexes[]) const>
+void bloom_filter_t::probe_batch(const void *const keys[], const size_t lens[],
+				 size_t count, bool results[]) const
+{
+	static_assert(max_hashes % 4 == 0, "padded indexes fit");
+
+	const size_t batch_size = 16;
+	const size_t stride     = (num_hashes_ + 3) / 4 * 4;
+	uint64_t     indexes[batch_size * max_hashes];
+
+	for (size_t first = 0; first < count; first += batch_size) {
+		size_t size = std::min(batch_size, count - first);
+
+		for (size_t i = 0; i < size; i++) {
+			uint64_t  hash[2];
+			uint64_t *key_indexes = &indexes[i * stride];
+
+			this->hash(keys[first + i], lens[first + i], hash);
+
+			for (size_t j = 0; j < num_hashes_; j++) {
+				key_indexes[j] = index(hash, j);
+				__builtin_prefetch(&buckets_[key_indexes[j] / 64]);
+			}
+
+			std::fill(key_indexes + num_hashes_, key_indexes + stride,
+				  key_indexes[num_hashes_ - 1]);
+		}
+
+		for (size_t i = 0; i < size; i++)
+			results[first + i] = (this->*Probe)(&indexes[i * stride]);
+	}
+}
+
+inline void bloom_filter_t::set_bit(size_t n)
+{
+	buckets_[n / 64] |= 1ULL << n % 64;
+}
+
+inline void bloom_filter_t::set_bit_atomic(size_t n)
+{
+	__atomic_fetch_or(&buckets_[n / 64], 1ULL << n % 64, __ATOMIC_RELAXED);
+}
+
+// A relaxed load costs the same as a plain one, and keeps lookups
+// racing with insert_atomic() well defined
+inline bool bloom_filter_t::get_bit(size_t n) const
+{
+	return __atomic_load_n(&buckets_[n / 64], __ATOMIC_RELAXED) & 1ULL << n % 64;
+}
+
+blocked_bloom_filter_t::blocked_bloom_filter_t(size_t num_keys, double error_rate)
+{
+	auto filter = calculate_filter(num_keys, error_rate);
+
+	num_hashes_ = filter.first;
+	num_blocks_ = filter.second;
+	blocks_     = allocate_words(num_blocks_ * block_words);
+}
+
+blocked_bloom_filter_t::blocked_bloom_filter_t(size_t num_hashes, size_t num_blocks,
+					       bloom_words_t blocks):
+	num_hashes_(num_hashes),
+	num_blocks_(num_blocks),
+	blocks_(std::move(blocks))
+{ }
+
+// The second hash is split in two for the bits inside the block, the
+// odd step visits every bit before repeating one
+void blocked_bloom_filter_t::insert(const void *key, size_t len)
+{
+	uint64_t  hash[2];
+	uint64_t *words;
+
+	assert(blocks_.get_deleter().mapping == nullptr);
+
+	MurmurHash3_x64_128(key, len, seed_, hash);
+	words = block(hash);
+
+	for (size_t i = 0; i < num_hashes_; i++) {
+		size_t bit = (hash[1] + i * (hash[1] >> 32 | 1)) % block_bits;
+
+		words[bit / 64] |= 1ULL << bit % 64;
+	}
+}
+
+void blocked_bloom_filter_t::insert_atomic(const void *key, size_t len)
+{
+	uint64_t  hash[2];
+	uint64_t *words;
+
+	assert(blocks_.get_deleter().mapping == nullptr);
+
+	MurmurHash3_x64_128(key, len, seed_, hash);
+	words = block(hash);
+
+	for (size_t i = 0; i < num_hashes_; i++) {
+		size_t bit = (hash[1] + i * (hash[1] >> 32 | 1)) % block_bits;
+
+		__atomic_fetch_or(&words[bit / 64], 1ULL << bit % 64, __ATOMIC_RELAXED);
+	}
+}
+
+bool blocked_bloom_filter_t::member(const void *key, size_t len) const
 {
 	uint64_t hash[2];
 
 	MurmurHash3_x64_128(key, len, seed_, hash);
-	for (size_t i = 0; i < num_hashes_; i++)
-		indexes_[i] = (hash[0] + i * hash[1]) % num_buckets_;
+
+	return probe(hash);
 }
 
-inline void bloom_filter_t::set_bit(size_t n)
+void blocked_bloom_filter_t::member_batch(const void *const keys[], const size_t lens[],
+					  size_t count, bool results[], bloom_simd_t simd) const
+{
+	switch (std::min(simd, cpu_simd())) {
+	case bloom_simd_avx512:
+		probe_batch<&blocked_bloom_filter_t::probe_avx512>(keys, lens, count, results);
+		break;
+	case bloom_simd_avx2:
+		probe_batch<&blocked_bloom_filter_t::probe_avx2>(keys, lens, count, results);
+		break;
+	default:
+		probe_batch<&blocked_bloom_filter_t::probe>(keys, lens, count, results);
+	}
+}
+
+inline bool blocked_bloom_filter_t::probe(const uint64_t hash[2]) const
+{
+	uint64_t *words = block(hash);
+
+	for (size_t i = 0; i < num_hashes_; i++) {
+		size_t bit = (hash[1] + i * (hash[1] >> 32 | 1)) % block_bits;
+
+		if ((__atomic_load_n(&words[bit / 64], __ATOMIC_RELAXED) & 1ULL << bit % 64) == 0)
+			return false;
+	}
+
+	return true;
+}
+
+void blocked_bloom_filter_t::clear()
+{
+	assert(blocks_.get_deleter().mapping == nullptr);
+	std::fill_n(blocks_.get(), num_blocks_ * block_words, 0);
+}
+
+size_t blocked_bloom_filter_t::count() const
+{
+	return popcount(blocks_.get(), num_blocks_ * block_words);
+}
+
+void blocked_bloom_filter_t::save(const char *path) const
+{
+	save_words(path, scheme_blocked, num_hashes_, seed_, blocks_.get(),
+		   num_blocks_ * block_words);
+}
+
+std::unique_ptr<const blocked_bloom_filter_t> blocked_bloom_filter_t::load(const char *path,
+									   bool check_bits)
 {
-	buckets_[n / 8] |= (1 << n % 8);
+	file_header_t                                 header;
+	bloom_words_t                                 blocks = load_words(path, scheme_blocked, check_bits, header);
+	std::unique_ptr<const blocked_bloom_filter_t> filter;
+
+	if (blocks && header.num_words % block_words == 0)
+		filter.reset(new blocked_bloom_filter_t(header.num_hashes,
+							header.num_words / block_words,
+							std::move(blocks)));
+
+	if (filter && filter->seed_ != header.seed)
+		filter.reset();
+
+	return filter;
 }
 
-inline int bloom_filter_t::get_bit(size_t n) const
+std::ostream &operator<<(std::ostream &stream, const blocked_bloom_filter_t &filter)
 {
-	return buckets_[n / 8] & (1 << n % 8);
+	stream << "=== blocked_bloom_filter_t ===\n";
+	stream << "num_hashes_  = " << filter.num_hashes_  << "\n";
+	stream << "num_blocks_  = " << filter.num_blocks_  << "\n";
+	stream << "seed_        = " << filter.seed_        << "\n";
+	stream << "count()      = " << filter.count()      << "\n";
+
+	return stream;
+}
+
+// Starts from the bits of a standard filter and grows them until the
+// best number of hashes brings the error rate down to the one asked
+std::pair<size_t, size_t> blocked_bloom_filter_t::calculate_filter(size_t num_keys, double error_rate)
+{
+	auto   filter     = bloom_filter_t::calculate_filter(num_keys, error_rate);
+	size_t num_blocks = std::max<size_t>(1, ceil(filter.second / double(block_bits)));
+
+	while (true) {
+		size_t best_num_hashes = 1;
+		double best_error_rate = 1;
+
+		for (size_t num_hashes = 1; num_hashes <= 2 * filter.first; num_hashes++) {
+			double rate = blocked_bloom_filter_t::error_rate(num_keys, num_blocks, num_hashes);
+
+			if (rate < best_error_rate) {
+				best_num_hashes = num_hashes;
+				best_error_rate = rate;
+			}
+		}
+
+		if (best_error_rate <= error_rate)
+			return {best_num_hashes, num_blocks};
+
+		num_blocks += std::max<size_t>(1, num_blocks / 32);
+	}
+}
+
+// Ref: Felix Putze, Peter Sanders and Johannes Singler
+//      Cache-, Hash- and Space-Efficient Bloom Filters
+//
+// The keys in a block follow a Poisson distribution, each block is a
+// standard filter of block_bits bits for the keys it got
+double blocked_bloom_filter_t::error_rate(size_t num_keys, size_t num_blocks, size_t num_hashes)
+{
+	double mean = num_keys / double(num_blocks);
+	size_t last = mean + 10 * sqrt(mean) + 10;
+	double rate = 0;
+
+	if (num_keys == 0)
+		return 0;
+
+	for (size_t keys = 0; keys <= last; keys++) {
+		double probability = exp(keys * log(mean) - mean - lgamma(keys + 1.0));
+		double block_rate  = pow(1 - pow(1 - 1.0 / block_bits, num_hashes * keys),
+		                         num_hashes);
+
+		rate += probability * block_rate;
+	}
+
+	return rate;
+}
+
+// Picked by the first hash
+inline uint64_t *blocked_bloom_filter_t::block(const uint64_t hash[2]) const
+{
+	return blocks_.get() + reduce(hash[0], num_blocks_) * block_words;
+}
+
+// Every bit of the key in its block, vector probes compare it with the
+// whole block at once
+inline void blocked_bloom_filter_t::mask(const uint64_t hash[2], uint64_t mask[block_words]) const
+{
+	std::fill_n(mask, block_words, 0);
+
+	for (size_t i = 0; i < num_hashes_; i++) {
+		size_t bit = (hash[1] + i * (hash[1] >> 32 | 1)) % block_bits;
+
+		mask[bit / 64] |= 1ULL << bit % 64;
+	}
+}
+
+__attribute__((target("avx2")))
+bool blocked_bloom_filter_t::probe_avx2(const uint64_t hash[2]) const
+{
+	const __m256i *words = reinterpret_cast<const __m256i *>(block(hash));
+	uint64_t       bits[block_words];
+
+	mask(hash, bits);
+
+	const __m256i *masks = reinterpret_cast<const __m256i *>(bits);
+
+	return _mm256_testc_si256(_mm256_load_si256(&words[0]), _mm256_loadu_si256(&masks[0])) &&
+	       _mm256_testc_si256(_mm256_load_si256(&words[1]), _mm256_loadu_si256(&masks[1]));
+}
+
+__attribute__((target("avx512f")))
+bool blocked_bloom_filter_t::probe_avx512(const uint64_t hash[2]) const
+{
+	__m512i  words = _mm512_load_si512(block(hash));
+	uint64_t bits[block_words];
+
+	mask(hash, bits);
+
+	__m512i masks = _mm512_loadu_si512(bits);
+
+	return _mm512_cmpneq_epi64_mask(_mm512_and_si512(words, masks), masks) == 0;
+}
+
+// Hashes and prefetches the blocks of a whole batch before probing it
+template<bool (blocked_bloom_filter_t::*Probe)(const uint64_t hash[2]) const>
+void blocked_bloom_filter_t::probe_batch(const void *const keys[], const size_t lens[],
+					 size_t count, bool results[]) const
+{
+	const size_t batch_size = 16;
+	uint64_t     hashes[batch_size][2];
+
+	for (size_t first = 0; first < count; first += batch_size) {
+		size_t size = std::min(batch_size, count - first);
+
+		for (size_t i = 0; i < size; i++) {
+			MurmurHash3_x64_128(keys[first + i], lens[first + i], seed_, hashes[i]);
+			__builtin_prefetch(block(hashes[i]));
+		}
+
+		for (size_t i = 0; i < size; i++)
+			results[first + i] = (this->*Probe)(hashes[i]);
+	}
 }
 
 }
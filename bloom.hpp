@@ -5,33 +5,132 @@
 #include <memory>
 #include <cstdint>
 #include <cmath>
+#include <cstdlib>
 
 namespace lvldb
 {
 
+// Frees the bits of a filter, or unmaps the file they were loaded from
+struct bloom_words_deleter_t
+{
+	void   *mapping = nullptr;
+	size_t  size    = 0;
+
+	void operator()(uint64_t *words) const;
+};
+
+typedef std::unique_ptr<uint64_t[], bloom_words_deleter_t> bloom_words_t;
+
+// Vector instructions of batched lookups, by default the widest the CPU
+// has. Asking for wider ones than the CPU or the filter has gets those.
+enum bloom_simd_t {bloom_simd_none, bloom_simd_avx2, bloom_simd_avx512, bloom_simd_best};
+
+// Lookups are safe from any number of threads. So are inserts with
+// insert_atomic(), even alongside lookups, while insert() is only safe
+// with no other thread using the filter.
+//
+// member_batch() looks up many keys at once. It hashes a few of them
+// and prefetches their bits before probing any, so their cache misses
+// overlap, and probes with the widest vector instructions the CPU has.
+//
+// save() writes the filter to a file that load() maps back without
+// reading or copying it, as a const filter since the mapping is read
+// only. The format is versioned, holds the parameters, seed and hash
+// scheme of the filter and checksums them along with the bits. It may
+// run alongside insert_atomic(), saving some of the concurrent inserts.
 class bloom_filter_t
 {
 	public:
 
 	bloom_filter_t(size_t num_keys, double error_rate);
 	void insert(const void *key, size_t len);
+	void insert_atomic(const void *key, size_t len);
 	bool member(const void *key, size_t len) const;
+	void member_batch(const void *const keys[], const size_t lens[], size_t count,
+			  bool results[], bloom_simd_t simd = bloom_simd_best) const;
 	void clear();
 	size_t count() const;
+	void save(const char *path) const;
+
+	// Null if the file is missing, not a filter like this one or its
+	// header is corrupt. Checking the bits too means reading them all.
+	static std::unique_ptr<const bloom_filter_t> load(const char *path, bool check_bits = false);
 
 	friend std::ostream &operator<<(std::ostream &stream, const bloom_filter_t &filter);
 
 	private:
 
-	size_t                     num_hashes_, num_buckets_;
-	std::unique_ptr<size_t[]>  indexes_;
-	std::unique_ptr<uint8_t[]> buckets_;
-	const uint32_t             seed_ = M_E * 1000000000;
+	friend class blocked_bloom_filter_t;
+
+	// Lower error rates than the one it gives are beyond what 64 bit
+	// hashes can tell apart
+	static const size_t max_hashes = 64;
+
+	size_t         num_hashes_, num_buckets_;
+	bloom_words_t  buckets_;
+	const uint32_t seed_ = M_E * 1000000000;
+
+	bloom_filter_t(size_t num_hashes, size_t num_buckets, bloom_words_t buckets);
 
 	static std::pair<size_t, size_t> calculate_filter(size_t num_keys, double error_rate);
-	void generate_indexes(const void *key, size_t len) const;
+	void hash(const void *key, size_t len, uint64_t hash[2]) const;
+	size_t index(const uint64_t hash[2], size_t i) const;
+	bool probe(const uint64_t indexes[]) const;
+	bool probe_avx2(const uint64_t indexes[]) const;
+	template<bool (bloom_filter_t::*Probe)(const uint64_t indexes[]) const>
+	void probe_batch(const void *const keys[], const size_t lens[], size_t count,
+			 bool results[]) const;
 	void set_bit(size_t n);
-	int get_bit(size_t n) const;
+	void set_bit_atomic(size_t n);
+	bool get_bit(size_t n) const;
+};
+
+// Sets every bit of a key inside a single block, picked by one of its
+// hashes, so a lookup touches a single cache line. Keys spread unevenly
+// over the blocks, so it needs a few more bits than bloom_filter_t for
+// the same error rate. Safe from several threads and saved like
+// bloom_filter_t.
+class blocked_bloom_filter_t
+{
+	public:
+
+	blocked_bloom_filter_t(size_t num_keys, double error_rate);
+	void insert(const void *key, size_t len);
+	void insert_atomic(const void *key, size_t len);
+	bool member(const void *key, size_t len) const;
+	void member_batch(const void *const keys[], const size_t lens[], size_t count,
+			  bool results[], bloom_simd_t simd = bloom_simd_best) const;
+	void clear();
+	size_t count() const;
+	void save(const char *path) const;
+
+	static std::unique_ptr<const blocked_bloom_filter_t> load(const char *path,
+								  bool check_bits = false);
+
+	friend std::ostream &operator<<(std::ostream &stream, const blocked_bloom_filter_t &filter);
+
+	private:
+
+	static const size_t block_size  = 64;
+	static const size_t block_bits  = block_size * 8;
+	static const size_t block_words = block_size / sizeof(uint64_t);
+
+	size_t         num_hashes_, num_blocks_;
+	bloom_words_t  blocks_;
+	const uint32_t seed_ = M_E * 1000000000;
+
+	blocked_bloom_filter_t(size_t num_hashes, size_t num_blocks, bloom_words_t blocks);
+
+	static std::pair<size_t, size_t> calculate_filter(size_t num_keys, double error_rate);
+	static double error_rate(size_t num_keys, size_t num_blocks, size_t num_hashes);
+	uint64_t *block(const uint64_t hash[2]) const;
+	void mask(const uint64_t hash[2], uint64_t mask[block_words]) const;
+	bool probe(const uint64_t hash[2]) const;
+	bool probe_avx2(const uint64_t hash[2]) const;
+	bool probe_avx512(const uint64_t hash[2]) const;
+	template<bool (blocked_bloom_filter_t::*Probe)(const uint64_t hash[2]) const>
+	void probe_batch(const void *const keys[], const size_t lens[], size_t count,
+			 bool results[]) const;
 };
 
 }
@@ -1,18 +1,141 @@
 #include <iostream>
 #include <set>
+#include <vector>
+#include <thread>
+#include <string>
+#include <atomic>
+#include <cstdio>
 #include <cassert>
 
+#include <unistd.h>
+
 #include "bloom.hpp"
 
 #define TEST_SIZE       100000
 #define TEST_ERROR_RATE 0.01
 
-int main(int argc, char *argv[])
+#define TEST_THREADS    4
+
+// Writers insert with atomic ORs while readers keep finding the keys
+// inserted before they started
+template<typename Filter>
+void test_concurrent(Filter &bloom)
+{
+	std::vector<std::thread> threads;
+
+	bloom.clear();
+
+	for (int i = 0; i < TEST_SIZE / 2; i++)
+		bloom.insert(&i, sizeof(i));
+
+	for (int t = 0; t < TEST_THREADS; t++) {
+		threads.emplace_back([&bloom, t]() {
+			for (int i = TEST_SIZE / 2 + t; i < TEST_SIZE; i += TEST_THREADS)
+				bloom.insert_atomic(&i, sizeof(i));
+		});
+
+		threads.emplace_back([&bloom]() {
+			for (int i = 0; i < TEST_SIZE / 2; i++)
+				assert(bloom.member(&i, sizeof(i)));
+		});
+	}
+
+	for (std::thread &thread : threads)
+		thread.join();
+
+	for (int i = 0; i < TEST_SIZE; i++)
+		assert(bloom.member(&i, sizeof(i)));
+}
+
+// Batches agree with single lookups, for present and absent keys
+template<typename Filter>
+void test_batch(Filter &bloom)
 {
-	lvldb::bloom_filter_t bloom(TEST_SIZE, TEST_ERROR_RATE);
-	std::set<int>         set;
-	int                   false_positives = 0;
-	double                false_positives_rate;
+	std::vector<int>          keys(TEST_SIZE);
+	std::vector<const void *> pkeys(TEST_SIZE);
+	std::vector<size_t>       lens(TEST_SIZE, sizeof(int));
+	std::unique_ptr<bool[]>   results(new bool[TEST_SIZE]);
+
+	bloom.clear();
+
+	for (int i = 0; i < TEST_SIZE; i++) {
+		keys[i]  = i * 2;
+		pkeys[i] = &keys[i];
+
+		if (i % 2 == 0)
+			bloom.insert(&keys[i], sizeof(int));
+	}
+
+	// Every probe the CPU can run, with sizes that are not a multiple
+	// of the batch
+	for (lvldb::bloom_simd_t simd : {lvldb::bloom_simd_none, lvldb::bloom_simd_avx2,
+					 lvldb::bloom_simd_avx512}) {
+		bloom.member_batch(pkeys.data(), lens.data(), TEST_SIZE - 5, results.get(), simd);
+
+		for (int i = 0; i < TEST_SIZE - 5; i++)
+			assert(results[i] == bloom.member(&keys[i], sizeof(int)));
+	}
+}
+
+// Saved filters map back with the same keys, corrupt ones do not
+template<typename Filter>
+void test_save(Filter &bloom)
+{
+	std::string path = "/tmp/bloom_test." + std::to_string(getpid());
+
+	assert(Filter::load(path.c_str()) == nullptr);
+
+	bloom.save(path.c_str());
+
+	std::unique_ptr<const Filter> loaded = Filter::load(path.c_str(), true);
+
+	assert(loaded != nullptr);
+	assert(loaded->count() == bloom.count());
+
+	for (int i = 0; i < TEST_SIZE; i++)
+		assert(loaded->member(&i, sizeof(i)) == bloom.member(&i, sizeof(i)));
+
+	loaded.reset();
+
+	// Flips a bit of the last word
+	FILE *file = fopen(path.c_str(), "r+");
+	int   byte;
+
+	assert(file != nullptr);
+	fseek(file, -1, SEEK_END);
+	byte = fgetc(file);
+	fseek(file, -1, SEEK_END);
+	fputc(byte ^ 1, file);
+	fclose(file);
+
+	assert(Filter::load(path.c_str()) != nullptr);
+	assert(Filter::load(path.c_str(), true) == nullptr);
+
+	// Saves alongside inserts, the checksums must match the saved bits
+	std::atomic<bool> done(false);
+	std::thread       inserter([&bloom, &done]() {
+		for (int i = TEST_SIZE; !done; i++)
+			bloom.insert_atomic(&i, sizeof(i));
+	});
+
+	for (int i = 0; i < 200; i++) {
+		bloom.save(path.c_str());
+		assert(Filter::load(path.c_str(), true) != nullptr);
+	}
+
+	done = true;
+	inserter.join();
+
+	unlink(path.c_str());
+}
+
+template<typename Filter>
+void test_filter()
+{
+	Filter        bloom(TEST_SIZE, TEST_ERROR_RATE);
+	std::set<int> set;
+	int           false_positives = 0;
+	double        false_positives_rate;
 
 	bloom.insert("foo", 3);
 	bloom.insert("bar", 3);
@@ -25,7 +148,9 @@ int main(int argc, char *argv[])
 
 	std::cout << bloom;
 	std::cout << std::endl;
+	assert(bloom.count() > 0);
 	bloom.clear();
+	assert(bloom.count() == 0);
 
 	for (int i = 0; i < TEST_SIZE; i++) {
 		if (bloom.member(&i, sizeof(i)))
@@ -71,6 +196,17 @@ int main(int argc, char *argv[])
 	std::cout << "test_error_rate      = " << TEST_ERROR_RATE      << "\n";
 	std::cout << "false_positives      = " << false_positives      << "\n";
 	std::cout << "false_positives_rate = " << false_positives_rate << "\n";
+	std::cout << std::endl;
+
+	test_concurrent(bloom);
+	test_batch(bloom);
+	test_save(bloom);
+}
+
+int main(int argc, char *argv[])
+{
+	test_filter<lvldb::bloom_filter_t>();
+	test_filter<lvldb::blocked_bloom_filter_t>();
 
 	return 0;
 }
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+g++ -g -std=c++20 -Wall -Wextra -pedantic -pthread coroutine_test.cpp -o coroutine_test
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+g++ -DNDEBUG -O3 -std=c++11 -Wall -pedantic -pthread disruptor_bench.cpp -o disruptor_bench
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+g++ -g -DLVLDB_STATS -DNO_OUTPUT -std=c++11 -Wall -Wextra -pedantic -pthread disruptor_test.cpp -o disruptor_test_stats
@@ -0,0 +1,4 @@
+#!/bin/sh
+
+g++ -O3 -std=c++11 -Wall -pedantic -pthread disruptor_stress.cpp -o disruptor_stress
+g++ -O3 -DLVLDB_SEQ_CST -std=c++11 -Wall -pedantic -pthread disruptor_stress.cpp -o disruptor_stress_seq_cst
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+g++ -g -std=c++11 -Wall -Wextra -pedantic -pthread pipeline_test.cpp -o pipeline_test
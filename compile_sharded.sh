@@ -0,0 +1,3 @@
+#!/bin/sh
+
+g++ -g -std=c++11 -Wall -Wextra -pedantic -pthread sharded_test.cpp murmurhash/MurmurHash3.cpp -o sharded_test
@@ -0,0 +1,430 @@
+#ifndef COROUTINE_HPP
+#define COROUTINE_HPP
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+
+#include "disruptor.hpp"
+
+// Needs C++20, unlike the rest of the disruptor
+namespace lvldb
+{
+
+class executor_t;
+
+// Something an executor resumes once it is ready
+struct waiter_t
+{
+	std::coroutine_handle<> handle;
+
+	// Checked by the threads of the executor, never concurrently
+	virtual bool ready() = 0;
+
+	// Once not ready, arranges to be scheduled again when it may be,
+	// false if it became ready meanwhile
+	virtual bool park() = 0;
+
+	protected:
+
+	~waiter_t() { }
+};
+
+// A stage written as a coroutine, it does not run until spawned on an
+// executor and it is over once it returns:
+//
+//	lvldb::stage_t consume(lvldb::async_task_t<Fence> &task)
+//	{
+//		while (size_t count = co_await task.acquire()) {
+//			for (size_t i = 0; i < count; i++)
+//				process(task[task.first() + i]);
+//
+//			task.release();
+//		}
+//	}
+class stage_t
+{
+	public:
+
+	struct promise_type
+	{
+		struct start_t: public waiter_t
+		{
+			bool ready()
+			{
+				return true;
+			}
+
+			bool park()
+			{
+				return false;
+			}
+		};
+
+		struct final_t
+		{
+			bool await_ready() noexcept
+			{
+				return false;
+			}
+
+			// The stage is suspended for good, so it can be destroyed
+			// as soon as it is marked as done
+			void await_suspend(std::coroutine_handle<promise_type> handle) noexcept;
+
+			void await_resume() noexcept { }
+		};
+
+		executor_t *executor = nullptr;
+		bool        done     = false;
+		start_t     start;
+
+		stage_t get_return_object()
+		{
+			return stage_t(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		final_t final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void return_void() { }
+
+		void unhandled_exception()
+		{
+			std::terminate();
+		}
+	};
+
+	stage_t(stage_t &&other):
+		handle_(other.handle_)
+	{
+		other.handle_ = nullptr;
+	}
+
+	stage_t(const stage_t &) = delete;
+	stage_t &operator=(const stage_t &) = delete;
+
+	// Must be over if it was spawned
+	~stage_t()
+	{
+		if (handle_)
+			handle_.destroy();
+	}
+
+	private:
+
+	friend class executor_t;
+
+	std::coroutine_handle<promise_type> handle_;
+
+	stage_t(std::coroutine_handle<promise_type> handle):
+		handle_(handle)
+	{ }
+};
+
+// A few threads running many stages. A stage runs until it waits on
+// its fence, it is then parked on the event of the fence holding it
+// back and queued again once that fence publishes, to be resumed by
+// the first thread free. Threads sleep while no stage is queued.
+class executor_t
+{
+	public:
+
+	explicit executor_t(size_t threads = 1):
+		stop_(false)
+	{
+		assert(threads > 0);
+
+		for (size_t i = 0; i < threads; i++)
+			threads_.emplace_back([this]() { run(); });
+	}
+
+	executor_t(const executor_t &) = delete;
+	executor_t &operator=(const executor_t &) = delete;
+
+	// Every stage spawned must be over
+	~executor_t()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			assert(queue_.empty());
+			stop_ = true;
+		}
+
+		work_cond_.notify_all();
+
+		for (std::thread &thread : threads_)
+			thread.join();
+	}
+
+	// Like tasks, every stage must be created before any is spawned
+	void spawn(stage_t &stage)
+	{
+		stage_t::promise_type &promise = stage.handle_.promise();
+
+		assert(promise.executor == nullptr);
+
+		promise.executor     = this;
+		promise.start.handle = stage.handle_;
+		schedule(&promise.start);
+	}
+
+	// Waits until the stage returns, once its fence is halted and
+	// drained
+	void join(stage_t &stage)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+
+		done_cond_.wait(lock, [&stage]() {
+			return stage.handle_.promise().done;
+		});
+	}
+
+	void schedule(waiter_t *waiter)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			queue_.push_back(waiter);
+		}
+
+		work_cond_.notify_one();
+	}
+
+	private:
+
+	friend struct stage_t::promise_type::final_t;
+
+	std::mutex               mutex_;
+	std::condition_variable  work_cond_;
+	std::condition_variable  done_cond_;
+	std::deque<waiter_t *>   queue_;
+	bool                     stop_;
+	std::vector<std::thread> threads_;
+
+	void finish(stage_t::promise_type &promise)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			promise.done = true;
+		}
+
+		done_cond_.notify_all();
+	}
+
+	void run()
+	{
+		for (;;) {
+			waiter_t *waiter;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+
+				work_cond_.wait(lock, [this]() {
+					return stop_ || !queue_.empty();
+				});
+
+				if (queue_.empty())
+					return;
+
+				waiter = queue_.front();
+				queue_.pop_front();
+			}
+
+			if (waiter->ready() || !waiter->park())
+				waiter->handle.resume();
+		}
+	}
+};
+
+inline void stage_t::promise_type::final_t::await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+{
+	handle.promise().executor->finish(handle.promise());
+}
+
+// The seat of a stage on a fence, what a task is to a thread. Only
+// fences which can try to acquire slots work, atomic_fence_t ones.
+// The fence is made blocking, so the fences it gates on notify their
+// event whenever they publish. A stage acquiring in a loop yields its
+// thread now and then even if it never waits, so it cannot starve the
+// others.
+template<typename Fence>
+class async_task_t
+{
+	public:
+
+	typedef typename Fence::slot_t slot_t;
+
+	class acquire_t: public waiter_t, public event_callback_t
+	{
+		public:
+
+		acquire_t(async_task_t &task):
+			task_(task),
+			state_(parking)
+		{ }
+
+		bool await_ready()
+		{
+			if (++task_.streak_ % max_streak == 0)
+				return false;
+
+			return ready();
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			this->handle = handle;
+			task_.executor_.schedule(this);
+		}
+
+		size_t await_resume()
+		{
+			return task_.count_;
+		}
+
+		// Still ready if the fence was halted, with nothing claimed.
+		// Slots are claimed once, ready() then stays true.
+		bool ready()
+		{
+#ifdef LVLDB_STATS
+			task_stats_t::current() = &task_.stats_;
+#endif
+			if (task_.count_ == 0)
+				task_.count_ = task_.fence_.try_acquire_slots(task_.seq_.value,
+									      task_.max_batch_);
+
+			return task_.count_ > 0 || task_.fence_.finished();
+		}
+
+		// Only the next fence holding back the gate needs to move,
+		// the others are checked again once it does. Halting the
+		// fence notifies it too. A notify() while parking does not
+		// schedule the stage, which is still being checked, so it
+		// parks again unless ready.
+		bool park()
+		{
+			for (;;) {
+				event_count_t &event = task_.fence_.slowest().event();
+				int            state = parking;
+
+				state_ = parking;
+				event.prepare_callback(*this);
+
+				bool ready = this->ready();
+
+				if (ready && event.cancel_callback(*this))
+					return false;
+
+				if (state_.compare_exchange_strong(state, parked))
+					return true;
+
+				if (ready)
+					return false;
+			}
+		}
+
+		void notify()
+		{
+			if (state_.exchange(notified) == parked)
+				task_.executor_.schedule(this);
+		}
+
+		private:
+
+		enum {parking, parked, notified};
+
+		async_task_t     &task_;
+		std::atomic<int>  state_;
+	};
+
+	async_task_t(Fence &fence, executor_t &executor, size_t max_batch = 1):
+		seq_(0),
+		fence_(fence),
+		executor_(executor),
+		max_batch_(max_batch),
+		count_(0),
+		streak_(0)
+	{
+		assert(max_batch > 0);
+
+		fence_.add_task(*this);
+		fence_.set_blocking();
+	}
+
+	async_task_t(const async_task_t &) = delete;
+	async_task_t &operator=(const async_task_t &) = delete;
+
+	// Resumes with how many slots were claimed from first(), 0 once the
+	// fence is halted and drained
+	acquire_t acquire()
+	{
+		assert(count_ == 0);
+
+		return acquire_t(*this);
+	}
+
+	// Releases every slot claimed
+	void release()
+	{
+#ifdef LVLDB_STATS
+		task_stats_t::current() = &stats_;
+#endif
+		fence_.release_slot(seq_.value, count_);
+		count_ = 0;
+	}
+
+	// First sequence claimed
+	seq_t first() const
+	{
+		return seq_.value;
+	}
+
+	slot_t &operator[](seq_t seq)
+	{
+		return fence_[seq];
+	}
+
+	const atomic_seq_t *seq() const
+	{
+		return &seq_.value;
+	}
+
+#ifdef LVLDB_STATS
+	const task_stats_t &stats() const
+	{
+		return stats_;
+	}
+#endif
+
+	private:
+
+	static const size_t max_streak = 64;
+
+	padded_t<atomic_seq_t>  seq_;
+	Fence                  &fence_;
+	executor_t             &executor_;
+	const size_t            max_batch_;
+	size_t                  count_;
+	size_t                  streak_;
+#ifdef LVLDB_STATS
+	task_stats_t            stats_;
+#endif
+};
+
+}
+
+#endif
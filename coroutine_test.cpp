@@ -0,0 +1,156 @@
+#include <iostream>
+#include <memory>
+
+#include <sys/resource.h>
+
+#include "coroutine.hpp"
+
+typedef lvldb::disruptor_t<long>                                     disruptor_t;
+typedef lvldb::atomic_fence_t<disruptor_t, lvldb::single_writer_t>   fence_t;
+typedef lvldb::async_task_t<fence_t>                                 task_t;
+
+// A chain of stages, each one adding to the slot what the previous
+// one left, far more stages than threads to run them
+const long stages = 8;
+
+lvldb::stage_t produce(task_t &task, size_t size)
+{
+	while (size_t count = co_await task.acquire()) {
+		for (size_t i = 0; i < count; i++) {
+			lvldb::seq_t  seq  = task.first() + i;
+			long         &slot = task[seq];
+
+			assert(seq < size ? slot == 0 :
+			       slot == static_cast<long>(seq - size) * 16 + stages);
+			(void) size;
+
+			slot = seq * 16;
+		}
+
+		task.release();
+	}
+}
+
+lvldb::stage_t consume(task_t &task, long stage)
+{
+	while (size_t count = co_await task.acquire()) {
+		for (size_t i = 0; i < count; i++) {
+			lvldb::seq_t  seq  = task.first() + i;
+			long         &slot = task[seq];
+
+			assert(slot == static_cast<long>(seq) * 16 + stage - 1);
+
+			slot = seq * 16 + stage;
+		}
+
+		task.release();
+	}
+}
+
+double cpu_time()
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) == -1) {
+		perror("getrusage");
+		exit(EXIT_FAILURE);
+	}
+
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+	       usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// A stage waiting on an idle publisher sleeps, and resumes once events
+// are published
+void check_idle(size_t size, size_t threads)
+{
+	typedef lvldb::atomic_fence_t<disruptor_t, lvldb::multi_producer_t> publisher_fence_t;
+
+	disruptor_t                           d(size);
+	publisher_fence_t                     f0(d, publisher_fence_t::producer);
+	fence_t                               f1(d, fence_t::consumer);
+	lvldb::publisher_t<publisher_fence_t> publisher(f0);
+	lvldb::executor_t                     executor(threads);
+	task_t                                task(f1, executor, 4);
+	lvldb::stage_t                        stage = consume(task, 1);
+
+	f0.set_next_fence(&f1);
+	f1.set_next_fence(&f0);
+
+	executor.spawn(stage);
+	usleep(100 * 1000);
+
+	double cpu = cpu_time();
+
+	sleep(1);
+	cpu = cpu_time() - cpu;
+
+	std::cerr << "idle cpu = " << cpu << " s" << std::endl;
+	assert(cpu < 0.05);
+
+	for (size_t i = 0; i < size * 4; i++) {
+		publisher.acquire();
+		publisher[publisher.seq()] = publisher.seq() * 16;
+		publisher.publish();
+	}
+
+	f0.halt();
+	f1.halt();
+	executor.join(stage);
+
+	assert(f1.cursor() == size * 4);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3) {
+		std::cerr << "Usage: " << argv[0] << " <disruptor size> <threads>\n";
+
+		return EXIT_FAILURE;
+	}
+
+	size_t                                size    = std::stoi(argv[1]);
+	size_t                                threads = std::stoi(argv[2]);
+	disruptor_t                           d(size);
+	std::vector<std::unique_ptr<fence_t>> fences;
+	std::vector<std::unique_ptr<task_t>>  tasks;
+	std::vector<lvldb::stage_t>           coroutines;
+	lvldb::executor_t                     executor(threads);
+
+	fences.emplace_back(new fence_t(d, fence_t::producer));
+
+	for (long stage = 1; stage <= stages; stage++) {
+		fences.emplace_back(new fence_t(d, fence_t::consumer));
+		fences[stage]->set_next_fence(fences[stage - 1].get());
+	}
+
+	fences[0]->set_next_fence(fences[stages].get());
+
+	for (long stage = 0; stage <= stages; stage++)
+		tasks.emplace_back(new task_t(*fences[stage], executor, 4));
+
+	coroutines.push_back(produce(*tasks[0], size));
+
+	for (long stage = 1; stage <= stages; stage++)
+		coroutines.push_back(consume(*tasks[stage], stage));
+
+	for (lvldb::stage_t &coroutine : coroutines)
+		executor.spawn(coroutine);
+
+	sleep(5);
+
+	// Halted in order, so every stage drains the previous one
+	for (long stage = 0; stage <= stages; stage++) {
+		fences[stage]->halt();
+		executor.join(coroutines[stage]);
+	}
+
+	for (long stage = 1; stage <= stages; stage++)
+		assert(fences[stage]->cursor() == fences[0]->cursor());
+
+	std::cerr << "finished seq = " << fences[0]->cursor() << std::endl;
+
+	check_idle(size, threads);
+
+	return 0;
+}
@@ -1,14 +1,30 @@
+#ifndef DISRUPTOR_HPP
+#define DISRUPTOR_HPP
+
 #include <vector>
 #include <memory>
+#include <functional>
+#include <utility>
+#include <new>
+#include <type_traits>
+#include <algorithm>
 #include <atomic>
 #include <limits>
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
 #include <cassert>
 
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 
 namespace lvldb
 {
@@ -18,371 +34,1978 @@ typedef std::atomic<seq_t> atomic_seq_t;
 
 const seq_t max_seq = std::numeric_limits<seq_t>::max();
 
-void check_cache_overlap(size_t type_size)
+// Memory orderings of the fence protocol. A task stores its sequence
+// with release once it is done with every slot before it, and fences
+// load the sequences they gate on with acquire, so the next tasks to
+// claim those slots see what was written to them: consumers read what
+// producers wrote and producers overwrite what consumers already read.
+// The marks of multi_producer_t and the gates a fence caches for its
+// other tasks carry the same guarantee. The claim cursor only hands out
+// sequences and carries no data, so it is relaxed. Halting and the
+// start signal are release stores read with acquire.
+//
+// Compiling with LVLDB_SEQ_CST makes all of them seq_cst, to tell an
+// ordering bug from any other.
+#ifdef LVLDB_SEQ_CST
+const std::memory_order seq_relaxed = std::memory_order_seq_cst;
+const std::memory_order seq_acquire = std::memory_order_seq_cst;
+const std::memory_order seq_release = std::memory_order_seq_cst;
+#else
+const std::memory_order seq_relaxed = std::memory_order_relaxed;
+const std::memory_order seq_acquire = std::memory_order_acquire;
+const std::memory_order seq_release = std::memory_order_release;
+#endif
+
+// Upper bound of the cache line size, padding to it also keeps apart
+// the pairs of lines that adjacent-line prefetchers fetch together
+const size_t max_line_size = 128;
+
+inline size_t cache_line_size()
 {
-	long line_size;
+	static const long line_size = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
 
-	if ((line_size = sysconf(_SC_LEVEL1_DCACHE_LINESIZE)) == -1) {
+	if (line_size == -1) {
 		perror("sysconf");
 		exit(EXIT_FAILURE);
 	}
 
-	assert(type_size >= static_cast<size_t>(line_size));
+	assert(line_size <= static_cast<long>(max_line_size));
+
+	// Unknown to some kernels
+	return line_size > 0 ? line_size : 64;
 }
 
-template<typename Slot>
-class disruptor_t
+// Keeps value alone in its cache lines whatever the alignment of the
+// enclosing object, which C++11 does not guarantee for over-aligned
+// types on the heap
+template<typename T>
+struct padded_t
 {
-	public:
+	template<typename... Args>
+	padded_t(Args&&... args):
+		value(std::forward<Args>(args)...)
+	{ }
 
-	typedef Slot slot_t;
+	char before_[max_line_size];
+	T    value;
+	char after_[max_line_size];
+};
 
-	disruptor_t(size_t size):
-		size_(size),
-		ring_(std::unique_ptr<slot_t[]>(new slot_t[size]()))
-	{
-		// Test if size is a power of two
-		assert((size & (size - 1)) == 0);
-	}
+// Opt-in instrumentation, compiled with LVLDB_STATS. Each task keeps
+// its own counters and only its thread writes them, so they are
+// updated without locked instructions and read from any thread.
+#ifdef LVLDB_STATS
+#define LVLDB_STAT(counter) lvldb::task_stats_t::count(&lvldb::task_stats_t::counter)
+#else
+#define LVLDB_STAT(counter) ((void) 0)
+#endif
+
+// Counter written by a single thread and read from any
+class counter_t
+{
+	public:
 
-	inline size_t get_index(seq_t seq)
-	{
-		// Fast algorithm to find the modulo of a power of two
-		return seq & (size_ - 1);
-	}
+	counter_t():
+		value_(0)
+	{ }
 
-	inline slot_t operator[](seq_t seq) const
+	// Single writer
+	inline void add(uint64_t n = 1)
 	{
-		return ring_[get_index(seq)];
+		value_.store(value_.load(std::memory_order_relaxed) + n,
+		             std::memory_order_relaxed);
 	}
 
-	inline slot_t &operator[](seq_t seq)
+	inline uint64_t get() const
 	{
-		return ring_[get_index(seq)];
+		return value_.load(std::memory_order_relaxed);
 	}
 
 	private:
 
-	const size_t              size_;
-	std::unique_ptr<slot_t[]> ring_;
+	std::atomic<uint64_t> value_;
 };
 
-template<typename Disr>
-class fence_t
+// Log-linear buckets like HDR histograms, every bucket is within 1/16
+// of the values it holds
+class histogram_t
 {
 	public:
 
-	typedef typename Disr::slot_t slot_t;
-	enum type_t {producer, consumer};
+	static const int    sub_bits = 4;
+	static const size_t buckets  = (64 - sub_bits + 1) << sub_bits;
 
-	fence_t(Disr &disruptor, type_t type):
-		disruptor_(disruptor),
-		type_(type)
-	{ }
+	// Single writer
+	inline void record(uint64_t value)
+	{
+		counts_[bucket(value)].add();
+	}
 
-	void set_next_fence(const fence_t *next_fence)
+	uint64_t count() const
 	{
-		next_fence_ = next_fence;
+		uint64_t count = 0;
+
+		for (size_t i = 0; i < buckets; i++)
+			count += counts_[i].get();
+
+		return count;
 	}
 
-	virtual slot_t &acquire_slot(atomic_seq_t &task_seq) = 0;
-	virtual slot_t &acquire_slot_directly(atomic_seq_t &task_seq) = 0;
-	virtual void release_slot(atomic_seq_t &task_seq) = 0;
-	virtual void release_slot_directly(atomic_seq_t &task_seq) = 0;
+	// Upper bound of the bucket holding the nearest rank percentile p,
+	// between 0 and 1, or 0 if nothing was recorded
+	uint64_t percentile(double p) const
+	{
+		uint64_t total = count(), rank = p * total, seen = 0;
 
-	protected:
+		if (rank < p * total || rank == 0)
+			rank++;
 
-	Disr          &disruptor_;
-	const type_t   type_;
-	const fence_t *next_fence_;
-};
+		for (size_t i = 0; i < buckets && total > 0; i++) {
+			seen += counts_[i].get();
 
-template<typename Fence>
-class task_t;
+			if (seen >= rank)
+				return highest(i);
+		}
 
-template<typename Disr>
-class atomic_fence_t: public fence_t<Disr>
-{
-	public:
+		return 0;
+	}
 
-	typedef typename Disr::slot_t slot_t;
+	void add(const histogram_t &other)
+	{
+		for (size_t i = 0; i < buckets; i++)
+			counts_[i].add(other.counts_[i].get());
+	}
 
-	atomic_fence_t(Disr &disruptor, typename fence_t<Disr>::type_t type,
-		       int atomic_retries = 32, int atomic_sleep = 25):
-		fence_t<Disr>(disruptor, type),
-		next_(0),
-		atomic_retries_(atomic_retries),
-		atomic_sleep_(atomic_sleep),
-		start_signal_(false)
+	private:
+
+	counter_t counts_[buckets];
+
+	static inline size_t bucket(uint64_t value)
 	{
-		check_cache_overlap(sizeof(atomic_fence_t));
+		if (value < (1 << sub_bits))
+			return value;
+
+		int shift = 63 - __builtin_clzll(value) - sub_bits;
+
+		return ((shift + 1) << sub_bits) +
+		       ((value >> shift) & ((1 << sub_bits) - 1));
 	}
 
-	void add_task(const task_t<atomic_fence_t<Disr>> &task)
+	static inline uint64_t highest(size_t bucket)
 	{
-		seqs_.push_back(task.seq());
+		if (bucket < (1 << sub_bits))
+			return bucket;
+
+		int      shift = (bucket >> sub_bits) - 1;
+		uint64_t sub   = bucket & ((1 << sub_bits) - 1);
+
+		return (((1 << sub_bits) + sub) << shift) + (1ULL << shift) - 1;
 	}
+};
 
-	void signal_start()
+#ifdef LVLDB_STATS
+struct task_stats_t
+{
+	counter_t   claims;    // Successful acquire_slots()
+	counter_t   retries;   // Claims lost to another task
+	counter_t   slots;     // Slots claimed
+	counter_t   spins;     // Pauses while waiting
+	counter_t   yields;    // sched_yield() while waiting
+	counter_t   sleeps;    // nanosleep() while waiting
+	counter_t   parks;     // Futex or condition waits
+	histogram_t batches;   // Slots per claim
+	histogram_t occupancy; // Producers: slots in use, consumers: backlog
+	histogram_t latency;   // Nanoseconds from publish to release
+
+	void add(const task_stats_t &other)
 	{
-		start_signal_ = true;
+		claims.add(other.claims.get());
+		retries.add(other.retries.get());
+		slots.add(other.slots.get());
+		spins.add(other.spins.get());
+		yields.add(other.yields.get());
+		sleeps.add(other.sleeps.get());
+		parks.add(other.parks.get());
+		batches.add(other.batches);
+		occupancy.add(other.occupancy);
+		latency.add(other.latency);
 	}
 
-	void wait_start()
+	// Stats of the task running on the thread, if any
+	static task_stats_t *&current()
 	{
-		int pauses = 0;
+		static thread_local task_stats_t *stats = nullptr;
 
-		while (!start_signal_)
-			pause_thread(pauses);
+		return stats;
 	}
 
-	slot_t &acquire_slot(atomic_seq_t &task_seq)
+	static inline void count(counter_t task_stats_t::*counter)
 	{
-		check_consistency();
+		if (task_stats_t *stats = current())
+			(stats->*counter).add();
+	}
+};
+#endif
 
-		while (true) {
-			int   pauses = 0;
-			seq_t next;
-
-			if (this->type_ == fence_t<Disr>::producer) {
-				while (true) {
-					next = next_;
-
-					if (this->disruptor_.get_index(next) ==
-					    this->disruptor_.get_index(next_fence()->min_seq())) {
-						task_seq = next;
-						pause_thread(pauses);
-					} else
-						break;
-				}
-			} else {
-				while (true) {
-					next = next_;
-
-					if (next == next_fence()->min_seq()) {
-						task_seq = next;
-						pause_thread(pauses);
-					} else
-						break;
-				}
+inline uint64_t monotonic_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Deadline of waits that only end once ready
+const uint64_t no_deadline = std::numeric_limits<uint64_t>::max();
+
+// Nanoseconds to sleep for at most timeout, or for ever if negative,
+// without going past deadline, a time from monotonic_ns()
+inline int64_t wait_time(int64_t timeout, uint64_t deadline)
+{
+	if (deadline == no_deadline)
+		return timeout;
+
+	uint64_t now  = monotonic_ns();
+	int64_t  left = deadline > now ? deadline - now : 0;
+
+	return timeout < 0 ? left : std::min(timeout, left);
+}
+
+// Allocation flags for the ring of disruptor_t
+enum ring_flags_t {
+	ring_huge_pages = 1 << 0, // Back the ring with 2 MB pages
+	ring_prefault   = 1 << 1, // Fault every page in at construction
+	ring_line_slots = 1 << 2  // Give every slot its own cache lines
+};
+
+// Anonymous mapping placed as the ring flags ask, bound to numa_node if
+// it is not negative. Pages are only touched when prefaulted, so the
+// memory policy is applied before the first page fault.
+class memory_map_t
+{
+	public:
+
+	memory_map_t(size_t bytes, int flags, int numa_node)
+	{
+		long   page_size;
+		size_t align;
+
+		if ((page_size = sysconf(_SC_PAGESIZE)) == -1) {
+			perror("sysconf");
+			exit(EXIT_FAILURE);
+		}
+
+		align  = flags & ring_huge_pages ? huge_page_size : page_size;
+		bytes_ = (bytes + align - 1) / align * align;
+		data_  = static_cast<char *>(MAP_FAILED);
+
+		// Reserved huge pages are only there if the admin set them up
+		if (flags & ring_huge_pages)
+			data_ = static_cast<char *>(mmap(nullptr, bytes_, PROT_READ | PROT_WRITE,
+			                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+			                                 -1, 0));
+
+		if (data_ == MAP_FAILED) {
+			data_ = map_aligned(align);
+
+			// Transparent huge pages need the region aligned to them,
+			// kernels without them keep the normal pages
+			if (flags & ring_huge_pages &&
+			    madvise(data_, bytes_, MADV_HUGEPAGE) == -1 && errno != EINVAL) {
+				perror("madvise");
+				exit(EXIT_FAILURE);
 			}
+		}
 
-			if (!next_.compare_exchange_strong(next, next + 1))
-				continue;
+		if (numa_node >= 0)
+			bind_node(numa_node);
 
-			task_seq = next;
-			break;
+		if (flags & ring_prefault) {
+			for (size_t i = 0; i < bytes_; i += page_size)
+				static_cast<volatile char *>(data_)[i] = 0;
 		}
+	}
 
-		check_consistency();
+	memory_map_t(const memory_map_t &) = delete;
+	memory_map_t &operator=(const memory_map_t &) = delete;
 
-		return this->disruptor_[task_seq];
+	~memory_map_t()
+	{
+		munmap(data_, bytes_);
 	}
 
-	inline void release_slot(atomic_seq_t &task_seq)
+	inline char *data() const
 	{
-		seq_t next   = next_;
-		int   pauses = 0;
+		return data_;
+	}
 
-		check_consistency();
+	private:
 
-		while (this->disruptor_.get_index(next) ==
-		       this->disruptor_.get_index(next_fence()->min_seq()))
-			pause_thread(pauses);
+	static const size_t huge_page_size = 2 * 1024 * 1024;
 
-		task_seq = next;
+	size_t  bytes_;
+	char   *data_;
 
-		check_consistency();
+	// Maps align more bytes than needed and trims both ends
+	char *map_aligned(size_t align)
+	{
+		char *data, *aligned;
+
+		data = static_cast<char *>(mmap(nullptr, bytes_ + align,
+		                                PROT_READ | PROT_WRITE,
+		                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+		if (data == MAP_FAILED) {
+			perror("mmap");
+			exit(EXIT_FAILURE);
+		}
+
+		aligned = reinterpret_cast<char *>(
+			(reinterpret_cast<uintptr_t>(data) + align - 1) / align * align);
+
+		if (aligned > data)
+			munmap(data, aligned - data);
+
+		munmap(aligned + bytes_, data + align - aligned);
+
+		return aligned;
 	}
 
-	slot_t &acquire_slot_directly(atomic_seq_t &task_seq)
+	// Calls mbind(2) directly, libnuma is not needed for a single node
+	void bind_node(int numa_node)
 	{
-		task_seq = next_++;
+		const size_t               bits = CHAR_BIT * sizeof(unsigned long);
+		std::vector<unsigned long> mask(numa_node / bits + 1);
+
+		mask[numa_node / bits] = 1UL << numa_node % bits;
 
-		return this->disruptor_[task_seq];
+		// The kernel ignores the last bit of maxnode
+		if (syscall(SYS_mbind, data_, bytes_, MPOL_BIND, mask.data(),
+		            mask.size() * bits + 1, 0) == -1) {
+			perror("mbind");
+			exit(EXIT_FAILURE);
+		}
 	}
+};
+
+inline void cpu_relax()
+{
+	__asm__ __volatile__("pause" ::: "memory");
+}
+
+// Called back by an event count instead of waking up a thread
+struct event_callback_t
+{
+	event_callback_t *next_callback = nullptr;
+
+	// From the thread notifying the event count
+	virtual void notify() = 0;
+
+	protected:
+
+	~event_callback_t() { }
+};
+
+// Ref: Ulrich Drepper
+//      Futexes Are Tricky
+//
+// A shared event count can be placed in memory shared between processes,
+// its callbacks only work within the process registering them.
+class event_count_t
+{
+	public:
 
-	void release_slot_directly(atomic_seq_t &task_seq)
+	explicit event_count_t(bool shared = false):
+		epoch_(0),
+		waiters_(0),
+		private_(shared ? 0 : FUTEX_PRIVATE_FLAG),
+		callbacks_(nullptr),
+		locked_(false)
 	{
-		task_seq.store(next_.load());
+		static_assert(sizeof(epoch_) == sizeof(unsigned), "futex word size");
 	}
 
-	private:
+	// The condition must be checked again after taking the ticket and
+	// before calling wait(), a notify() in between is never lost
+	unsigned prepare_wait()
+	{
+		waiters_.fetch_add(1, std::memory_order_relaxed);
 
-	char                              padding_[64];
-	atomic_seq_t                      next_;
-	const int                         atomic_retries_;
-	const int                         atomic_sleep_; // Milliseconds
-	std::atomic<bool>                 start_signal_;
-	std::vector<const atomic_seq_t *> seqs_;
+		// Pairs with the one in notify(), either the condition checked
+		// next sees the store or notify() sees the waiter
+		std::atomic_thread_fence(std::memory_order_seq_cst);
 
-	inline const atomic_fence_t *next_fence()
+		return epoch_;
+	}
+
+	void cancel_wait()
+	{
+		waiters_--;
+	}
+
+	// Waits for timeout nanoseconds, for ever if it is negative
+	void wait(unsigned ticket, int64_t timeout)
 	{
-		const atomic_fence_t *fence =
-			static_cast<const atomic_fence_t *>(this->next_fence_);
+		struct timespec req = {static_cast<time_t>(timeout / 1000000000),
+		                       static_cast<long>(timeout % 1000000000)};
 
-		assert(dynamic_cast<const atomic_fence_t *>(this->next_fence_) != nullptr);
+		if (futex(FUTEX_WAIT | private_, ticket, timeout < 0 ? nullptr : &req) == -1 &&
+		    errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+			perror("futex");
+			exit(EXIT_FAILURE);
+		}
 
-		return fence;
+		waiters_--;
 	}
 
-	inline void pause_thread(int &pauses)
+	// Like prepare_wait(), but callback is called back once by the next
+	// notify() instead of a thread waiting
+	void prepare_callback(event_callback_t &callback)
 	{
-		if (pauses < atomic_retries_)
-			__asm__ __volatile__("pause" ::: "memory");
-		else {
-			struct timespec req = {0, atomic_sleep_ * 1000 * 1000};
+		lock();
+		callback.next_callback = callbacks_.load(std::memory_order_relaxed);
+		callbacks_.store(&callback, std::memory_order_relaxed);
+		unlock();
 
-			pthread_testcancel();
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
 
-			if (nanosleep(&req, nullptr) == -1) {
-				perror("nanosleep");
-				exit(EXIT_FAILURE);
+	// False if a notify() already took the callback, it is then called
+	// back anyway
+	bool cancel_callback(event_callback_t &callback)
+	{
+		event_callback_t *head;
+		bool              found = false;
+
+		lock();
+		head = callbacks_.load(std::memory_order_relaxed);
+
+		if (head == &callback) {
+			callbacks_.store(callback.next_callback, std::memory_order_relaxed);
+			found = true;
+		}
+
+		for (event_callback_t *prev = head; prev != nullptr && !found;
+		     prev = prev->next_callback) {
+			if (prev->next_callback == &callback) {
+				prev->next_callback = callback.next_callback;
+				found = true;
 			}
 		}
 
-		pauses++;
+		unlock();
+
+		return found;
 	}
 
-	seq_t min_seq() const
+	// Must follow the store that makes the condition true
+	void notify()
 	{
-		seq_t min = max_seq;
-
-		assert(seqs_.size() > 0);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
 
-		for (const atomic_seq_t *pseq : seqs_) {
-			seq_t seq = std::atomic_load(pseq);
+		if (waiters_.load(std::memory_order_relaxed) > 0) {
+			epoch_++;
 
-			min = seq < min ? seq : min;
+			if (futex(FUTEX_WAKE | private_, INT_MAX, nullptr) == -1) {
+				perror("futex");
+				exit(EXIT_FAILURE);
+			}
 		}
 
-		return min;
+		if (callbacks_.load(std::memory_order_relaxed) != nullptr) {
+			event_callback_t *callback;
+
+			lock();
+			callback = callbacks_.load(std::memory_order_relaxed);
+			callbacks_.store(nullptr, std::memory_order_relaxed);
+			unlock();
+
+			// A callback can register again as soon as it is called
+			while (callback != nullptr) {
+				event_callback_t *next = callback->next_callback;
+
+				callback->notify();
+				callback = next;
+			}
+		}
 	}
 
-	bool check_seqs()
+	private:
+
+	std::atomic<unsigned>           epoch_;
+	std::atomic<int>                waiters_;
+	const int                       private_;
+	std::atomic<event_callback_t *> callbacks_;
+	std::atomic<bool>               locked_;
+
+	// Only held to add or take callbacks
+	inline void lock()
 	{
-		for (const atomic_seq_t *pseq : seqs_) {
-			if (std::atomic_load(pseq) > next_)
-				return false;
-		}
+		while (locked_.exchange(true, std::memory_order_acquire))
+			cpu_relax();
+	}
 
-		return true;
+	inline void unlock()
+	{
+		locked_.store(false, std::memory_order_release);
 	}
 
-	inline void check_consistency()
+	long futex(int op, unsigned val, const struct timespec *timeout)
 	{
-		assert(this->type_ == fence_t<Disr>::producer ?
-		       next_fence()->type_ == fence_t<Disr>::consumer : true);
-		assert(this->next_fence_ != nullptr);
-		assert(next_ < max_seq);
-		assert(check_seqs());
+		return syscall(SYS_futex, reinterpret_cast<unsigned *>(&epoch_),
+		               op, val, timeout, nullptr, 0);
 	}
 };
 
-// XXX XXX XXX
-//template<typename Disr>
-//class mutex_fence_t: public fence_t<Disr>
-//{
-//        private:
-
-//        char            padding_[64];
-//        seq_t           seq_;
-//        pthread_mutex_t seq_mutex_ = PTHREAD_MUTEX_INITIALIZER;
-//        pthread_cond_t  seq_cond_  = PTHREAD_COND_INITIALIZER;
-//};
-// XXX XXX XXX
+// Variable length record of a sequence, valid until the task reading it
+// releases the sequence
+struct record_t
+{
+	char   *data;
+	size_t  size;
+};
 
-template<typename Fence>
-class task_t
+// Byte ring for records carried by the slots of a disruptor, so they
+// travel through the pipeline without copies or heap allocations.
+// Producers allocate the record of every sequence they publish, in
+// sequence order and taking turns, empty records included. Records are
+// contiguous and their bytes are recycled once the gate of the producer
+// fence is past their sequence.
+class arena_t
 {
 	public:
 
-	typedef typename Fence::slot_t slot_t;
-
-	task_t(Fence &fence, int acquire_directly, int test_cancel_iters = 256):
-		seq_(max_seq),
-		fence_(fence),
-		acquire_directly_(acquire_directly),
-		test_cancel_iters_(test_cancel_iters)
+	arena_t(size_t capacity, size_t slots, int flags, int numa_node):
+		capacity_(capacity),
+		slots_(slots),
+		map_(capacity, flags, numa_node),
+		begins_(new uint64_t[slots]()),
+		sizes_(new size_t[slots]()),
+		turn_(0),
+		cursor_(0)
 	{
-		check_cache_overlap(sizeof(task_t));
+		// Test if capacity is a power of two
+		assert((capacity & (capacity - 1)) == 0);
+	}
 
-		if (pthread_create(&thread_, nullptr, start_thread, this) != 0) {
-			perror("pthread_create");
-			exit(EXIT_FAILURE);
-		}
+	inline size_t capacity() const
+	{
+		return capacity_;
 	}
 
-	void start()
+	// Allocates size bytes for seq once every earlier sequence has its
+	// record, false if it is not its turn yet or the records from gate,
+	// the first sequence still being consumed, leave no room
+	bool try_allocate(seq_t seq, size_t size, seq_t gate, record_t &record)
 	{
-		fence_.signal_start();
+		assert(size <= capacity_);
+		assert(gate <= seq);
+
+		if (turn_.value.load(seq_acquire) != seq)
+			return false;
+
+		uint64_t begin = place(size);
+
+		if (!fits(seq, begin + size, gate))
+			return false;
+
+		begins_[get_index(seq)] = begin;
+		sizes_[get_index(seq)]  = size;
+		cursor_                 = begin + size;
+
+		turn_.value.store(seq + 1, seq_release);
+
+		record = this->record(seq);
+
+		return true;
 	}
 
-	void stop()
+	// Waits with the wait strategy of the producer fence for the turn of
+	// seq, then for the consumers to make room. The records of the batch
+	// being processed, from first, are only recycled once it is
+	// released, so it exits if they leave no room for this one.
+	template<typename Fence>
+	record_t allocate(seq_t seq, size_t size, const Fence &fence, seq_t first)
 	{
-		if (pthread_cancel(thread_) != 0) {
-			perror("pthread_cancel");
-			exit(EXIT_FAILURE);
-		}
+		record_t record;
 
-		if (pthread_join(thread_, nullptr) != 0) {
-			perror("pthread_join");
-			exit(EXIT_FAILURE);
+		assert(first <= seq);
+
+		if (!try_allocate(seq, size, fence.gate(), record)) {
+			fence.wait(turn_event_.value, [this, seq]() {
+				return turn_.value.load(seq_acquire) == seq;
+			});
+
+			if (!fits(seq, place(size) + size, first)) {
+				fprintf(stderr, "arena: records of the batch do not fit in %zu bytes\n",
+					capacity_);
+				exit(EXIT_FAILURE);
+			}
+
+			for (bool done = false; !done; ) {
+				const auto *slowest = &fence.slowest();
+
+				// Allocates once, ready() may be called again after
+				// it returned true
+				fence.wait(slowest->event(), [&]() {
+					if (!done)
+						done = try_allocate(seq, size, fence.gate(), record);
+
+					return done || &fence.slowest() != slowest;
+				});
+			}
 		}
+
+		// Producers of a blocking fence sleep while waiting their turn
+		if (fence.blocking())
+			turn_event_.value.notify();
+
+		return record;
 	}
 
-	const atomic_seq_t *seq() const
+	inline record_t record(seq_t seq) const
 	{
-		return &seq_;
+		size_t index = get_index(seq);
+
+		return {map_.data() + begins_[index] % capacity_, sizes_[index]};
 	}
 
-	protected:
+	private:
 
-	seq_t seq()
+	const size_t                capacity_;
+	const size_t                slots_;
+	const memory_map_t          map_;
+	std::unique_ptr<uint64_t[]> begins_;
+	std::unique_ptr<size_t[]>   sizes_;
+	padded_t<atomic_seq_t>      turn_;
+	padded_t<event_count_t>     turn_event_;
+
+	// Only written by the producer holding the turn
+	uint64_t                    cursor_;
+
+	inline size_t get_index(seq_t seq) const
 	{
-		return seq_;
+		return seq & (slots_ - 1);
 	}
 
-	private:
+	// Records never wrap around the end of the ring
+	inline uint64_t place(size_t size) const
+	{
+		uint64_t begin = cursor_;
 
-	char         padding_[64];
-	atomic_seq_t seq_;
-	Fence       &fence_;
-	const int    acquire_directly_;
-	const int    test_cancel_iters_;
-	pthread_t    thread_;
+		if (begin % capacity_ + size > capacity_)
+			begin += capacity_ - begin % capacity_;
 
-	static void *start_thread(void *arg)
-	{
-		static_cast<task_t *>(arg)->run();
+		return begin;
+	}
 
-		return nullptr;
+	// Whether the record of seq ending at end leaves room for the ones
+	// from gate, an empty arena always has room
+	inline bool fits(seq_t seq, uint64_t end, seq_t gate) const
+	{
+		return gate == seq || end - begins_[get_index(gate)] <= capacity_;
 	}
+};
 
-	void run()
+template<typename Slot>
+class disruptor_t
+{
+	public:
+
+	typedef Slot slot_t;
+
+	// Slots are only touched when constructed, or when prefaulted. An
+	// arena for variable length records is added if arena_size is not
+	// 0, placed like the ring.
+	disruptor_t(size_t size, int flags = 0, int numa_node = -1,
+		    size_t arena_size = 0):
+		size_(size),
+		stride_(flags & ring_line_slots ? line_stride() : sizeof(slot_t)),
+		ring_(size * stride_, flags, numa_node)
 	{
-		for (int i = 0; i < acquire_directly_; i++) {
-			slot_t &slot = fence_.acquire_slot_directly(seq_);
+		// Test if size is a power of two
+		assert((size & (size - 1)) == 0);
 
-			process_slot(slot);
-			fence_.release_slot_directly(seq_);
+		// Anonymous mappings come zeroed, which already is the value
+		// initialization of a trivial slot
+		if (!std::is_trivial<slot_t>::value) {
+			for (size_t i = 0; i < size_; i++)
+				new (&slot(i)) slot_t();
 		}
 
-		fence_.wait_start();
-
-		while (true) {
-			for (int i = 0; i < test_cancel_iters_; i++) {
-				slot_t &slot = fence_.acquire_slot(seq_);
+		if (arena_size > 0)
+			arena_.reset(new arena_t(arena_size, size, flags, numa_node));
+#ifdef LVLDB_STATS
+		stamps_.reset(new uint64_t[size]());
+#endif
+	}
 
-				process_slot(slot);
-				fence_.release_slot(seq_);
-			}
+	disruptor_t(const disruptor_t &) = delete;
+	disruptor_t &operator=(const disruptor_t &) = delete;
 
-			pthread_testcancel();
+	~disruptor_t()
+	{
+		if (!std::is_trivially_destructible<slot_t>::value) {
+			for (size_t i = 0; i < size_; i++)
+				slot(i).~slot_t();
 		}
 	}
 
-	virtual void process_slot(slot_t &slot) = 0;
-};
+	inline size_t size() const
+	{
+		return size_;
+	}
 
-}
+	inline size_t get_index(seq_t seq)
+	{
+		// Fast algorithm to find the modulo of a power of two
+		return seq & (size_ - 1);
+	}
+
+	inline slot_t operator[](seq_t seq) const
+	{
+		return slot(get_index(seq));
+	}
+
+	inline slot_t &operator[](seq_t seq)
+	{
+		return slot(get_index(seq));
+	}
+
+	inline arena_t &arena()
+	{
+		assert(arena_);
+
+		return *arena_;
+	}
+
+#ifdef LVLDB_STATS
+	// Publish time of each slot, ordered like the slot itself
+	inline uint64_t &stamp(seq_t seq)
+	{
+		return stamps_[get_index(seq)];
+	}
+#endif
+
+	private:
+
+	const size_t             size_;
+	const size_t             stride_;
+	const memory_map_t       ring_;
+	std::unique_ptr<arena_t> arena_;
+#ifdef LVLDB_STATS
+	std::unique_ptr<uint64_t[]> stamps_;
+#endif
+
+	inline slot_t &slot(size_t index) const
+	{
+		return *reinterpret_cast<slot_t *>(ring_.data() + index * stride_);
+	}
+
+	// Slots start at the page aligned ring, so rounding their size up
+	// to whole lines keeps neighbours out of them
+	static size_t line_stride()
+	{
+		size_t line_size = cache_line_size();
+
+		static_assert(alignof(slot_t) <= max_line_size, "slot alignment");
+
+		return (sizeof(slot_t) + line_size - 1) / line_size * line_size;
+	}
+};
+
+// Wait strategies for atomic_fence_t, they return once ready() is true.
+// The blocking ones sleep on the event count of the fence being waited
+// on, which notifies it as long as a blocking fence gates on it. Given a
+// deadline, a time from monotonic_ns() that ready() also checks, they
+// never sleep past it. They may call ready() again after it returned
+// true, so it must keep returning true without repeating side effects.
+
+// Lowest latency, burns a core while waiting
+struct busy_spin_wait_t
+{
+	static const bool blocking = false;
+
+	template<typename Ready>
+	void wait(event_count_t &, Ready ready, uint64_t = no_deadline) const
+	{
+		while (!ready()) {
+			cpu_relax();
+			LVLDB_STAT(spins);
+		}
+	}
+};
+
+// Gives the core away to other threads after spinning for a while
+struct yield_wait_t
+{
+	static const bool blocking = false;
+
+	yield_wait_t(int retries = 32):
+		retries_(retries)
+	{ }
+
+	template<typename Ready>
+	void wait(event_count_t &, Ready ready, uint64_t = no_deadline) const
+	{
+		for (int pauses = 0; !ready(); pauses++) {
+			if (pauses < retries_) {
+				cpu_relax();
+				LVLDB_STAT(spins);
+			} else {
+				sched_yield();
+				LVLDB_STAT(yields);
+			}
+		}
+	}
+
+	const int retries_;
+};
+
+// Sleeps a fixed time after spinning for a while, cheap on CPU but a
+// waiting task can take up to a whole sleep to see new sequences
+struct sleep_wait_t
+{
+	static const bool blocking = false;
+
+	sleep_wait_t(int retries = 32, int sleep = 25):
+		retries_(retries),
+		sleep_(sleep)
+	{ }
+
+	template<typename Ready>
+	void wait(event_count_t &, Ready ready, uint64_t deadline = no_deadline) const
+	{
+		for (int pauses = 0; !ready(); pauses++) {
+			if (pauses < retries_) {
+				cpu_relax();
+				LVLDB_STAT(spins);
+			} else {
+				int64_t         sleep = wait_time(sleep_ * 1000000LL, deadline);
+				struct timespec req   = {static_cast<time_t>(sleep / 1000000000),
+				                         static_cast<long>(sleep % 1000000000)};
+
+				LVLDB_STAT(sleeps);
+
+				if (nanosleep(&req, nullptr) == -1) {
+					perror("nanosleep");
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+	}
+
+	const int retries_;
+	const int sleep_; // Milliseconds
+};
+
+// Parks the thread on a futex until a task of the fence being waited on
+// publishes a new sequence, publishers pay a fence for the wake-up check.
+// A negative timeout parks until notified.
+struct blocking_wait_t
+{
+	static const bool blocking = true;
+
+	blocking_wait_t(int timeout = 100):
+		timeout_(timeout)
+	{ }
+
+	template<typename Ready>
+	void wait(event_count_t &event, Ready ready, uint64_t deadline = no_deadline) const
+	{
+		while (!ready())
+			park(event, ready, deadline);
+	}
+
+	template<typename Ready>
+	void park(event_count_t &event, Ready ready, uint64_t deadline) const
+	{
+		unsigned ticket = event.prepare_wait();
+
+		if (ready()) {
+			event.cancel_wait();
+			return;
+		}
+
+		LVLDB_STAT(parks);
+		event.wait(ticket, wait_time(timeout_ < 0 ? -1 : timeout_ * 1000000LL,
+					     deadline));
+	}
+
+	const int timeout_; // Milliseconds
+};
+
+// Spins, then yields and finally parks the thread like blocking_wait_t
+struct adaptive_wait_t: public blocking_wait_t
+{
+	adaptive_wait_t(int spins = 256, int yields = 16, int timeout = 100):
+		blocking_wait_t(timeout),
+		spins_(spins),
+		yields_(yields)
+	{ }
+
+	template<typename Ready>
+	void wait(event_count_t &event, Ready ready, uint64_t deadline = no_deadline) const
+	{
+		for (int pauses = 0; !ready(); pauses++) {
+			if (pauses < spins_) {
+				cpu_relax();
+				LVLDB_STAT(spins);
+			} else if (pauses < spins_ + yields_) {
+				sched_yield();
+				LVLDB_STAT(yields);
+			} else
+				park(event, ready, deadline);
+		}
+	}
+
+	const int spins_;
+	const int yields_;
+};
+
+template<typename Disr>
+class fence_t
+{
+	public:
+
+	typedef typename Disr::slot_t slot_t;
+	enum type_t {producer, consumer};
+
+	fence_t(Disr &disruptor, type_t type):
+		disruptor_(disruptor),
+		type_(type),
+		blocking_(false),
+		notifying_(false),
+		end_(max_seq)
+	{ }
+
+	virtual ~fence_t() { }
+
+	// The fence gates on the slowest of its next fences, a producer on
+	// the last consumers and a consumer on the ones it comes after.
+	// Fences of any kind can gate on each other.
+	void set_next_fence(const fence_t *next_fence)
+	{
+		next_fences_.clear();
+		add_next_fence(next_fence);
+	}
+
+	void add_next_fence(const fence_t *next_fence)
+	{
+		next_fences_.push_back(next_fence);
+
+		if (blocking_)
+			next_fence->notifying_ = true;
+	}
+
+	// Tasks of a blocking fence sleep on the events of its next fences,
+	// which then notify them whenever they publish. Set before any task
+	// of the fences starts.
+	void set_blocking()
+	{
+		blocking_ = true;
+
+		for (const fence_t *next_fence : next_fences_)
+			next_fence->notifying_ = true;
+	}
+
+	bool blocking() const
+	{
+		return blocking_;
+	}
+
+	template<typename Task>
+	void add_task(const Task &task)
+	{
+		seqs_.push_back(task.seq());
+#ifdef LVLDB_STATS
+		stats_.push_back(&task.stats());
+#endif
+	}
+
+#ifdef LVLDB_STATS
+	// Adds up the stats of the tasks of the fence, safe while they run
+	void stats(task_stats_t &total) const
+	{
+		for (const task_stats_t *stats : stats_)
+			total.add(*stats);
+	}
+#endif
+
+	type_t type() const
+	{
+		return type_;
+	}
+
+	// Gating sequence of the fence, every task attached to it has
+	// finished with all the sequences before it
+	virtual seq_t min_seq() const
+	{
+		seq_t min = max_seq;
+
+		assert(seqs_.size() > 0);
+
+		for (const atomic_seq_t *pseq : seqs_) {
+			seq_t seq = pseq->load(seq_acquire);
+
+			min = seq < min ? seq : min;
+		}
+
+		return min;
+	}
+
+	// Once halted, true when nothing is left to claim
+	bool finished() const
+	{
+		return cursor() >= end_.load(seq_acquire);
+	}
+
+	// Every sequence before it is done by the next fences, for a
+	// producer the ones that can be reused
+	seq_t gate() const
+	{
+		const fence_t *slowest;
+
+		return gate(next_fences_, slowest);
+	}
+
+	// Next fence holding back the gate, whose event tells when it moves
+	const fence_t &slowest() const
+	{
+		const fence_t *slowest;
+
+		gate(next_fences_, slowest);
+
+		return *slowest;
+	}
+
+	// Notified when a task of the fence publishes a new sequence and a
+	// blocking fence gates on it, and when a fence gating on it halts
+	event_count_t &event() const
+	{
+		return event_;
+	}
+
+	inline slot_t &operator[](seq_t seq)
+	{
+		return disruptor_[seq];
+	}
+
+	// Producers stop claiming right away, consumers drain everything
+	// claimed from the next fences, whose tasks must be stopped first
+	void halt()
+	{
+		seq_t end = max_seq;
+
+		if (type_ == producer)
+			end = 0;
+		else {
+			for (const fence_t *next_fence : next_fences_)
+				end = std::min(end, next_fence->cursor());
+		}
+
+		halt(end);
+	}
+
+	// No sequence at or past end is claimed, tasks leave their run
+	// loop once they get there
+	void halt(seq_t end)
+	{
+		end_.store(end, seq_release);
+
+		// Tasks wait on the next fences
+		for (const fence_t *next_fence : next_fences_)
+			next_fence->event().notify();
+	}
+
+	// Next sequence to be claimed from the fence
+	virtual seq_t cursor() const = 0;
+
+	// Tasks wait for the signal before claiming anything
+	virtual void signal_start() = 0;
+	virtual void wait_start() = 0;
+
+	// Waits like the tasks of the fence until ready(), for callers
+	// that wait on something else than the next fences
+	virtual void wait(event_count_t &event, const std::function<bool ()> &ready) const = 0;
+
+	// Returns 0 once the fence is halted
+	virtual size_t acquire_slots(atomic_seq_t &task_seq, size_t max_slots) = 0;
+
+	// Releases the count slots acquired last
+	virtual void release_slot(atomic_seq_t &task_seq, size_t count) = 0;
+
+	protected:
+
+	Disr                             &disruptor_;
+	const type_t                      type_;
+	bool                              blocking_;
+	mutable bool                      notifying_;
+	std::vector<const fence_t *>      next_fences_;
+	std::vector<const atomic_seq_t *> seqs_;
+	mutable event_count_t             event_;
+	atomic_seq_t                      end_;
+#ifdef LVLDB_STATS
+	std::vector<const task_stats_t *> stats_;
+#endif
+
+	// Number of sequences from next that can be claimed before
+	// reaching the gating sequence of the next fence. Whole sequences
+	// are compared, so a producer tells an empty ring (gate == next)
+	// from a full one, and a stale gate lower than the real one never
+	// yields more room than there is.
+	inline seq_t available(seq_t next, seq_t gate) const
+	{
+		if (type_ == producer)
+			return gate <= next && next - gate <= disruptor_.size() ?
+			       gate + disruptor_.size() - next : 0;
+		else
+			return gate > next ? gate - next : 0;
+	}
+
+	// Wakes the blocking fences gating on this one, once a task has
+	// published
+	inline void notify() const
+	{
+		if (notifying_)
+			event_.notify();
+	}
+
+	// Room is what the next fences left available to the claim
+	inline void record_claim(seq_t room, size_t count)
+	{
+#ifdef LVLDB_STATS
+		if (task_stats_t *stats = task_stats_t::current()) {
+			stats->claims.add();
+			stats->slots.add(count);
+			stats->batches.record(count);
+			stats->occupancy.record(type_ == producer ?
+						disruptor_.size() - room : room);
+		}
+#else
+		(void) room;
+		(void) count;
+#endif
+	}
+
+	// Producers stamp the slots before publishing them, consumers
+	// measure how long ago that was
+	inline void record_release(seq_t seq, size_t count)
+	{
+#ifdef LVLDB_STATS
+		task_stats_t *stats = task_stats_t::current();
+		uint64_t      now   = monotonic_ns();
+
+		for (size_t i = 0; i < count; i++) {
+			if (type_ == producer)
+				disruptor_.stamp(seq + i) = now;
+			else if (stats != nullptr)
+				stats->latency.record(now - disruptor_.stamp(seq + i));
+		}
+#else
+		(void) seq;
+		(void) count;
+#endif
+	}
+
+	// Gating sequence of the next fences, slowest is set to the one
+	// holding it back
+	template<typename Fence>
+	static seq_t gate(const std::vector<Fence *> &next_fences, Fence *&slowest)
+	{
+		seq_t gate = max_seq;
+
+		assert(next_fences.size() > 0);
+
+		slowest = nullptr;
+
+		for (Fence *next_fence : next_fences) {
+			seq_t seq = next_fence->min_seq();
+
+			if (seq < gate || slowest == nullptr) {
+				gate    = seq;
+				slowest = next_fence;
+			}
+		}
+
+		return gate;
+	}
+};
+
+// Claim policies for atomic_fence_t
+
+// Any number of tasks can claim sequences from the fence
+struct multi_writer_t
+{
+	static const bool single    = false;
+	static const bool sequenced = false;
+
+	static inline seq_t load(const atomic_seq_t &next)
+	{
+		return next.load(seq_relaxed);
+	}
+
+	static inline bool claim(atomic_seq_t &next, seq_t seq, seq_t count)
+	{
+		return next.compare_exchange_strong(seq, seq + count, seq_relaxed);
+	}
+};
+
+// A single task claims sequences from the fence, so it owns next_
+// and can update it without a locked instruction
+struct single_writer_t
+{
+	static const bool single    = true;
+	static const bool sequenced = false;
+
+	static inline seq_t load(const atomic_seq_t &next)
+	{
+		return next.load(seq_relaxed);
+	}
+
+	static inline bool claim(atomic_seq_t &next, seq_t seq, seq_t count)
+	{
+		next.store(seq + count, seq_relaxed);
+
+		return true;
+	}
+};
+
+// Any number of tasks can claim sequences from the fence and each one
+// marks the sequences it releases, so the gating sequence is the first
+// one not marked yet. A slow task only holds back the sequences it has
+// not released, not every sequence claimed after its own.
+struct multi_producer_t: public multi_writer_t
+{
+	static const bool sequenced = true;
+};
+
+template<typename Disr, typename Writer = multi_writer_t,
+         typename Wait = sleep_wait_t>
+class atomic_fence_t final: public fence_t<Disr>
+{
+	public:
+
+	typedef typename Disr::slot_t slot_t;
+	typedef Writer                writer_t;
+
+	atomic_fence_t(Disr &disruptor, typename fence_t<Disr>::type_t type,
+		       const Wait &wait = Wait()):
+		fence_t<Disr>(disruptor, type),
+		next_(0),
+		gate_cache_(0),
+		published_(0),
+		wait_(wait),
+		start_signal_(false)
+	{
+		if (Wait::blocking)
+			this->set_blocking();
+
+		if (Writer::sequenced) {
+			marks_.reset(new atomic_seq_t[disruptor.size()]);
+
+			// No sequence is marked before it is claimed
+			for (size_t i = 0; i < disruptor.size(); i++)
+				marks_[i] = max_seq;
+		}
+	}
+
+	template<typename Task>
+	void add_task(const Task &task)
+	{
+		assert(!Writer::single || this->seqs_.empty());
+
+		fence_t<Disr>::add_task(task);
+	}
+
+	seq_t cursor() const
+	{
+		return next_.value.load(seq_relaxed);
+	}
+
+	seq_t min_seq() const
+	{
+		return Writer::sequenced ? published_seq() : fence_t<Disr>::min_seq();
+	}
+
+	void signal_start()
+	{
+		start_signal_.store(true, seq_release);
+		this->event_.notify();
+	}
+
+	void wait_start()
+	{
+		wait_.wait(this->event_, [this]() {
+			return start_signal_.load(seq_acquire);
+		});
+	}
+
+	void wait(event_count_t &event, const std::function<bool ()> &ready) const
+	{
+		wait_.wait(event, ready);
+	}
+
+	// Claims up to max_slots contiguous sequences at once, task_seq is
+	// set to the first one and the count is returned
+	size_t acquire_slots(atomic_seq_t &task_seq, size_t max_slots)
+	{
+		return claim_slots(task_seq, max_slots, []() {
+			return false;
+		});
+	}
+
+	// Returns 0 right away if nothing can be claimed
+	size_t try_acquire_slots(atomic_seq_t &task_seq, size_t max_slots)
+	{
+		return claim_slots(task_seq, max_slots, []() {
+			return true;
+		});
+	}
+
+	// Returns 0 if nothing can be claimed before deadline, a time from
+	// monotonic_ns(), the wait strategy sleeps no longer than that
+	size_t acquire_slots(atomic_seq_t &task_seq, size_t max_slots,
+			     uint64_t deadline)
+	{
+		return claim_slots(task_seq, max_slots, [deadline]() {
+			return monotonic_ns() >= deadline;
+		}, deadline);
+	}
+
+	inline void release_slot(atomic_seq_t &task_seq, size_t count)
+	{
+		check_consistency();
+
+		this->record_release(task_seq, count);
+
+		if (Writer::sequenced) {
+			seq_t seq = task_seq.load(seq_relaxed);
+
+			for (size_t i = 0; i < count; i++)
+				marks_[get_index(seq + i)].store(seq + i, seq_release);
+		}
+
+		publish(task_seq, Writer::load(next_.value));
+
+		check_consistency();
+	}
+
+	private:
+
+	// Written by every claim
+	padded_t<atomic_seq_t>            next_;
+	padded_t<atomic_seq_t>            gate_cache_;
+	mutable padded_t<atomic_seq_t>    published_;
+	std::unique_ptr<atomic_seq_t[]>   marks_;
+	const Wait                        wait_;
+	std::atomic<bool>                 start_signal_;
+
+	// Waits until there is room, the fence is halted or give_up(),
+	// which must be true by deadline
+	template<typename Give_up>
+	size_t claim_slots(atomic_seq_t &task_seq, size_t max_slots, Give_up give_up,
+			   uint64_t deadline = no_deadline)
+	{
+		size_t count;
+
+		assert(max_slots > 0);
+		check_consistency();
+
+		// Waits on the next fence holding back the gate, and on the
+		// new one whenever another fence becomes the slowest
+		const fence_t<Disr> *waited = this->next_fences_.front();
+
+		while (true) {
+			const fence_t<Disr> *slowest = waited;
+			seq_t                next, end;
+
+			wait_.wait(waited->event(), [&]() {
+				next  = Writer::load(next_.value);
+				end   = this->end_.load(seq_acquire);
+				count = next < end ? gate_available(next, slowest) : 0;
+
+				if (count == 0 && task_seq.load(seq_relaxed) != next)
+					publish(task_seq, next);
+
+				return count > 0 || next >= end || slowest != waited ||
+				       give_up();
+			}, deadline);
+
+			if (count == 0) {
+				if (next >= end || give_up())
+					return 0;
+
+				waited = slowest;
+				continue;
+			}
+
+			seq_t room = count;
+
+			count = std::min(std::min(count, max_slots), end - next);
+
+			if (!Writer::claim(next_.value, next, count)) {
+				LVLDB_STAT(retries);
+				continue;
+			}
+
+			publish(task_seq, next);
+			this->record_claim(room, count);
+			break;
+		}
+
+		check_consistency();
+
+		return count;
+	}
+
+	// Only rescans the next fences when the cached gating sequence
+	// shows no room left, they may use a different claim policy as only
+	// their gating sequence is needed
+	inline seq_t gate_available(seq_t next, const fence_t<Disr> *&slowest)
+	{
+		seq_t count = this->available(next, gate_cache_.value.load(seq_acquire));
+
+		if (count == 0) {
+			seq_t gate = this->gate(this->next_fences_, slowest);
+
+			gate_cache_.value.store(gate, seq_release);
+			count             = this->available(next, gate);
+		}
+
+		return count;
+	}
+
+	inline size_t get_index(seq_t seq) const
+	{
+		return seq & (this->disruptor_.size() - 1);
+	}
+
+	// Scans the marks from the first sequence known to be published.
+	// A mark for a sequence a whole ring ahead cannot be there before
+	// the sequence is released, so a mark equal to its sequence is
+	// never stale.
+	seq_t published_seq() const
+	{
+		seq_t next = next_.value.load(seq_relaxed);
+		seq_t seq  = published_.value.load(seq_acquire);
+		seq_t cached;
+
+		while (seq < next && marks_[get_index(seq)].load(seq_acquire) == seq)
+			seq++;
+
+		// Concurrent scans only move the cache forward
+		cached = published_.value.load(seq_relaxed);
+
+		while (cached < seq &&
+		       !published_.value.compare_exchange_weak(cached, seq, seq_release,
+							       seq_relaxed))
+			;
+
+		return seq;
+	}
+
+	inline void publish(atomic_seq_t &task_seq, seq_t seq)
+	{
+		task_seq.store(seq, seq_release);
+		this->notify();
+	}
+
+	bool check_seqs()
+	{
+		for (const atomic_seq_t *pseq : this->seqs_) {
+			if (pseq->load(seq_relaxed) > next_.value.load(seq_relaxed))
+				return false;
+		}
+
+		return true;
+	}
+
+	bool check_next_fences()
+	{
+		for (const fence_t<Disr> *next_fence : this->next_fences_) {
+			if (this->type_ == fence_t<Disr>::producer &&
+			    next_fence->type() != fence_t<Disr>::consumer)
+				return false;
+		}
+
+		return true;
+	}
+
+	inline void check_consistency()
+	{
+		assert(!this->next_fences_.empty());
+		assert(check_next_fences());
+		assert(next_.value < max_seq);
+		assert(check_seqs());
+	}
+};
+
+// Claims under a mutex and sleeps instead of spinning, for pipelines
+// with little traffic where CPU usage matters more than latency. Tasks
+// wait for the start signal on a condition variable and for room on
+// the event counts of the next fences, which may be of any kind.
+template<typename Disr>
+class mutex_fence_t final: public fence_t<Disr>
+{
+	public:
+
+	typedef typename Disr::slot_t slot_t;
+
+	mutex_fence_t(Disr &disruptor, typename fence_t<Disr>::type_t type):
+		fence_t<Disr>(disruptor, type),
+		next_(0),
+		start_signal_(false),
+		wait_(-1)
+	{
+		if (pthread_mutex_init(&mutex_, nullptr) != 0) {
+			perror("pthread_mutex_init");
+			exit(EXIT_FAILURE);
+		}
+
+		if (pthread_cond_init(&cond_, nullptr) != 0) {
+			perror("pthread_cond_init");
+			exit(EXIT_FAILURE);
+		}
+
+		this->set_blocking();
+	}
+
+	~mutex_fence_t()
+	{
+		pthread_cond_destroy(&cond_);
+		pthread_mutex_destroy(&mutex_);
+	}
+
+	seq_t cursor() const
+	{
+		seq_t next;
+
+		lock();
+		next = next_;
+		unlock();
+
+		return next;
+	}
+
+	void signal_start()
+	{
+		lock();
+		start_signal_ = true;
+		broadcast();
+		unlock();
+	}
+
+	void wait_start()
+	{
+		lock();
+
+		while (!start_signal_) {
+			if (pthread_cond_wait(&cond_, &mutex_) != 0) {
+				perror("pthread_cond_wait");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		unlock();
+	}
+
+	void wait(event_count_t &event, const std::function<bool ()> &ready) const
+	{
+		wait_.wait(event, ready);
+	}
+
+	size_t acquire_slots(atomic_seq_t &task_seq, size_t max_slots)
+	{
+		size_t               count;
+		seq_t                next, end;
+		const fence_t<Disr> *slowest = nullptr;
+
+		assert(max_slots > 0);
+		assert(!this->next_fences_.empty());
+
+		lock();
+
+		while (true) {
+			next  = next_;
+			end   = this->end_.load(seq_acquire);
+			count = next < end ?
+				this->available(next, this->gate(this->next_fences_, slowest)) : 0;
+
+			if (count > 0)
+				break;
+
+			task_seq.store(next, seq_release);
+			unlock();
+			this->notify();
+
+			if (next >= end)
+				return 0;
+
+			// Never parks with the mutex held. Only the slowest
+			// next fence needs to move, the others are checked
+			// again after.
+			wait_.wait(slowest->event(), [&]() {
+				return this->available(next, slowest->min_seq()) > 0 ||
+				       next >= this->end_.load(seq_acquire);
+			});
+
+			lock();
+		}
+
+		seq_t room = count;
+
+		count  = std::min(std::min(count, max_slots), end - next);
+		next_ += count;
+		task_seq.store(next, seq_release);
+		this->record_claim(room, count);
+
+		unlock();
+		this->notify();
+
+		return count;
+	}
+
+	void release_slot(atomic_seq_t &task_seq, size_t count)
+	{
+		this->record_release(task_seq, count);
+
+		lock();
+		task_seq.store(next_, seq_release);
+		unlock();
+		this->notify();
+	}
+
+	private:
+
+	// Everything is written under the mutex, so it shares lines with
+	// it and is padded on both sides as a whole
+	char                    padding_[max_line_size];
+	seq_t                   next_;
+	bool                    start_signal_;
+	mutable pthread_mutex_t mutex_;
+	pthread_cond_t          cond_;
+	const blocking_wait_t   wait_;
+	char                    tail_padding_[max_line_size];
+
+	inline void lock() const
+	{
+		if (pthread_mutex_lock(&mutex_) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	inline void unlock() const
+	{
+		if (pthread_mutex_unlock(&mutex_) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	inline void broadcast()
+	{
+		if (pthread_cond_broadcast(&cond_) != 0) {
+			perror("pthread_cond_broadcast");
+			exit(EXIT_FAILURE);
+		}
+	}
+};
+
+// Statically dispatched task, Derived provides process_slot() and can
+// hide process_batch(), both must be accessible from this class. With a
+// final fence type every call in the run loop can be inlined.
+//
+// Fences tell an empty ring from a full one by comparing whole
+// sequences, so every task joins the ring at sequence 0 without
+// acquiring any slot beforehand. Tasks must be created before any of
+// them is started.
+template<typename Fence, typename Derived>
+class basic_task_t
+{
+	public:
+
+	typedef typename Fence::slot_t slot_t;
+
+	// Returns once the thread is waiting for start(), the thread is
+	// pinned to cpu if it is not negative
+	basic_task_t(Fence &fence, size_t max_batch = 1, int cpu = -1):
+		seq_(0),
+		slot_seq_(0),
+		fence_(fence),
+		max_batch_(max_batch),
+		ready_(false)
+	{
+		assert(max_batch > 0);
+
+		fence_.add_task(*this);
+
+		if (pthread_mutex_init(&ready_mutex_, nullptr) != 0) {
+			perror("pthread_mutex_init");
+			exit(EXIT_FAILURE);
+		}
+
+		if (pthread_cond_init(&ready_cond_, nullptr) != 0) {
+			perror("pthread_cond_init");
+			exit(EXIT_FAILURE);
+		}
+
+		create_thread(cpu);
+
+		pthread_mutex_lock(&ready_mutex_);
+
+		while (!ready_)
+			pthread_cond_wait(&ready_cond_, &ready_mutex_);
+
+		pthread_mutex_unlock(&ready_mutex_);
+	}
+
+	~basic_task_t()
+	{
+		pthread_cond_destroy(&ready_cond_);
+		pthread_mutex_destroy(&ready_mutex_);
+	}
+
+	void start()
+	{
+		fence_.signal_start();
+	}
+
+	// Halts the fence and waits for the thread to drain it, tasks must
+	// be stopped in pipeline order starting from the producers
+	void stop()
+	{
+		fence_.halt();
+		join();
+	}
+
+	// Waits for the thread to leave once the fence has been halted
+	void join()
+	{
+		if (pthread_join(thread_, nullptr) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	const atomic_seq_t *seq() const
+	{
+		return &seq_.value;
+	}
+
+#ifdef LVLDB_STATS
+	const task_stats_t &stats() const
+	{
+		return stats_;
+	}
+#endif
+
+	protected:
+
+	// Sequence of the slot being processed
+	seq_t seq()
+	{
+		return slot_seq_;
+	}
+
+	// First sequence of the batch being processed
+	seq_t batch_seq() const
+	{
+		return seq_.value.load(std::memory_order_relaxed);
+	}
+
+	slot_t &slot(seq_t seq)
+	{
+		return fence_[seq];
+	}
+
+	// The batch may wrap around the ring, use slot() to reach each
+	// sequence when hiding it
+	void process_batch(seq_t seq, size_t count)
+	{
+		for (size_t i = 0; i < count; i++) {
+			slot_seq_ = seq + i;
+			derived().process_slot(slot(slot_seq_));
+		}
+	}
+
+	private:
+
+	// Read by every claim on the next fence
+	padded_t<atomic_seq_t> seq_;
+	seq_t                  slot_seq_;
+	Fence                 &fence_;
+	const size_t           max_batch_;
+	pthread_t              thread_;
+	bool                   ready_;
+	pthread_mutex_t        ready_mutex_;
+	pthread_cond_t         ready_cond_;
+#ifdef LVLDB_STATS
+	task_stats_t           stats_;
+#endif
+
+	inline Derived &derived()
+	{
+		return *static_cast<Derived *>(this);
+	}
+
+	// Pinned before it starts, so the stack of the thread and what it
+	// touches first come from the memory node of the CPU
+	void create_thread(int cpu)
+	{
+		pthread_attr_t attr;
+
+		if (pthread_attr_init(&attr) != 0) {
+			perror("pthread_attr_init");
+			exit(EXIT_FAILURE);
+		}
+
+		if (cpu >= 0) {
+			cpu_set_t cpus;
+
+			CPU_ZERO(&cpus);
+			CPU_SET(cpu, &cpus);
+
+			if (pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus) != 0) {
+				perror("pthread_attr_setaffinity_np");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (pthread_create(&thread_, &attr, start_thread, this) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_attr_destroy(&attr);
+	}
+
+	static void *start_thread(void *arg)
+	{
+		static_cast<basic_task_t *>(arg)->run();
+
+		return nullptr;
+	}
+
+	void run()
+	{
+		pthread_mutex_lock(&ready_mutex_);
+		ready_ = true;
+		pthread_cond_signal(&ready_cond_);
+		pthread_mutex_unlock(&ready_mutex_);
+
+		fence_.wait_start();
+
+#ifdef LVLDB_STATS
+		task_stats_t::current() = &stats_;
+#endif
+
+		while (size_t count = fence_.acquire_slots(seq_.value, max_batch_)) {
+			derived().process_batch(seq_.value, count);
+			fence_.release_slot(seq_.value, count);
+		}
+	}
+};
+
+// Dynamically dispatched task, derived classes override process_slot()
+// and optionally process_batch()
+template<typename Fence>
+class task_t: public basic_task_t<Fence, task_t<Fence>>
+{
+	friend class basic_task_t<Fence, task_t>;
+
+	public:
+
+	typedef typename Fence::slot_t slot_t;
+
+	task_t(Fence &fence, size_t max_batch = 1, int cpu = -1):
+		basic_task_t<Fence, task_t>(fence, max_batch, cpu)
+	{ }
+
+	private:
+
+	virtual void process_slot(slot_t &slot) = 0;
+
+	virtual void process_batch(seq_t seq, size_t count)
+	{
+		basic_task_t<Fence, task_t>::process_batch(seq, count);
+	}
+};
+
+// Claims and publishes slots from any thread instead of a task, for
+// callers that would rather shed load than block on a full ring. Idle
+// publishers must not hold back the consumers, so the fence has to
+// gate on published sequences with multi_producer_t. A publisher is
+// used by one thread at a time.
+template<typename Fence>
+class publisher_t
+{
+	public:
+
+	typedef typename Fence::slot_t slot_t;
+
+	publisher_t(Fence &fence):
+		seq_(0),
+		count_(0),
+		fence_(fence)
+	{
+		static_assert(Fence::writer_t::sequenced,
+			      "publishers need a multi_producer_t fence");
+	}
+
+	// The next calls return how many slots were claimed from seq(), 0
+	// if the fence is halted
+
+	// Never waits, 0 on a full ring
+	size_t try_acquire(size_t max_slots = 1)
+	{
+		assert(count_ == 0);
+
+		return count_ = fence_.try_acquire_slots(seq_, max_slots);
+	}
+
+	// Waits up to deadline, a time from monotonic_ns()
+	size_t acquire(size_t max_slots, uint64_t deadline)
+	{
+		assert(count_ == 0);
+
+		return count_ = fence_.acquire_slots(seq_, max_slots, deadline);
+	}
+
+	size_t acquire(size_t max_slots = 1)
+	{
+		assert(count_ == 0);
+
+		return count_ = fence_.acquire_slots(seq_, max_slots);
+	}
+
+	// First sequence claimed
+	seq_t seq() const
+	{
+		return seq_;
+	}
+
+	slot_t &operator[](seq_t seq)
+	{
+		return fence_[seq];
+	}
+
+	// Publishes every slot claimed
+	void publish()
+	{
+		fence_.release_slot(seq_, count_);
+		count_ = 0;
+	}
+
+	private:
+
+	atomic_seq_t  seq_;
+	size_t        count_;
+	Fence        &fence_;
+};
+
+}
+
+#endif
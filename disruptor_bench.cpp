@@ -0,0 +1,369 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "pipeline.hpp"
+
+typedef lvldb::disruptor_t<long> disruptor_t;
+
+double now()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+		perror("clock_gettime");
+		exit(EXIT_FAILURE);
+	}
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpu_time()
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) == -1) {
+		perror("getrusage");
+		exit(EXIT_FAILURE);
+	}
+
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+	       usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Publishes events at a fixed rate, or as fast as possible if rate is 0
+template<typename Fence>
+class producer_t: public lvldb::basic_task_t<Fence, producer_t<Fence>>
+{
+	public:
+
+	producer_t(Fence &fence, long rate, int cpu):
+		lvldb::basic_task_t<Fence, producer_t>(fence, 1, cpu),
+		rate_(rate),
+		deadline_(0)
+	{ }
+
+	void process_slot(typename Fence::slot_t &slot)
+	{
+		slot = this->seq();
+
+		if (rate_ == 0)
+			return;
+
+		double time = now();
+
+		// Do not burst to catch up after falling behind
+		if (deadline_ < time - 0.01)
+			deadline_ = time;
+
+		deadline_ += 1.0 / rate_;
+
+		double delay = deadline_ - time;
+
+		if (delay > 0) {
+			struct timespec req = {static_cast<time_t>(delay),
+			                       static_cast<long>((delay - static_cast<time_t>(delay)) * 1e9)};
+
+			if (nanosleep(&req, nullptr) == -1) {
+				perror("nanosleep");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	private:
+
+	const long rate_;
+	double     deadline_;
+};
+
+template<typename Fence>
+class consumer_t: public lvldb::basic_task_t<Fence, consumer_t<Fence>>
+{
+	public:
+
+	consumer_t(Fence &fence, int cpu):
+		lvldb::basic_task_t<Fence, consumer_t>(fence, 1, cpu),
+		events_(0)
+	{ }
+
+	void process_slot(typename Fence::slot_t &slot)
+	{
+		assert(static_cast<lvldb::seq_t>(slot) == this->seq());
+		(void) slot;
+
+		events_++;
+	}
+
+	lvldb::seq_t events() const
+	{
+		return events_;
+	}
+
+	private:
+
+	lvldb::seq_t events_;
+};
+
+// CPU usage of a producer and a consumer at fixed rates
+template<typename Fence>
+void bench_rate(const std::string &name, size_t size, long rate, int secs,
+		const int cpus[2])
+{
+	disruptor_t          d(size, lvldb::ring_huge_pages | lvldb::ring_prefault |
+					 lvldb::ring_line_slots);
+	Fence                f1(d, Fence::producer);
+	Fence                f2(d, Fence::consumer);
+	producer_t<Fence>    producer(f1, rate, cpus[0]);
+	consumer_t<Fence>    consumer(f2, cpus[1]);
+
+	f1.set_next_fence(&f2);
+	f2.set_next_fence(&f1);
+
+	double wall = now();
+	double cpu  = cpu_time();
+
+	producer.start();
+	consumer.start();
+
+	sleep(secs);
+
+	producer.stop();
+	consumer.stop();
+
+	wall = now() - wall;
+	cpu  = cpu_time() - cpu;
+
+	std::cout << name << "," << rate << ","
+		  << static_cast<long>(consumer.events() / wall) << ","
+		  << static_cast<long>(100 * cpu / wall) << std::endl;
+}
+
+void bench_rates(size_t size, int secs, const int cpus[2])
+{
+	const long rates[] = {1000, 10000, 100000, 1000000, 0};
+
+	std::cout << "fence,rate,events_per_sec,cpu_percent" << std::endl;
+
+	for (long rate : rates) {
+		bench_rate<lvldb::atomic_fence_t<disruptor_t>>("atomic/sleep", size, rate, secs, cpus);
+		bench_rate<lvldb::atomic_fence_t<disruptor_t, lvldb::single_writer_t,
+			lvldb::busy_spin_wait_t>>("atomic/spin", size, rate, secs, cpus);
+		bench_rate<lvldb::atomic_fence_t<disruptor_t, lvldb::single_writer_t,
+			lvldb::blocking_wait_t>>("atomic/block", size, rate, secs, cpus);
+		bench_rate<lvldb::atomic_fence_t<disruptor_t, lvldb::single_writer_t,
+			lvldb::adaptive_wait_t>>("atomic/adaptive", size, rate, secs, cpus);
+		bench_rate<lvldb::mutex_fence_t<disruptor_t>>("mutex", size, rate, secs, cpus);
+	}
+}
+
+// Throughput and latency of whole topologies, built with pipeline_t
+
+const size_t       batch       = 16;
+const lvldb::seq_t sample_mask = 1023; // Latency of one event in 1024
+
+template<size_t Size>
+struct event_t
+{
+	lvldb::seq_t seq;
+	uint64_t     stamp; // Publish time of sampled events, 0 otherwise
+	char         payload[Size - 2 * sizeof(uint64_t)];
+};
+
+template<typename Fence>
+class publisher_t: public lvldb::basic_task_t<Fence, publisher_t<Fence>>
+{
+	public:
+
+	publisher_t(Fence &fence):
+		lvldb::basic_task_t<Fence, publisher_t>(fence, batch)
+	{ }
+
+	void process_slot(typename Fence::slot_t &event)
+	{
+		lvldb::seq_t seq = this->seq();
+
+		event.seq   = seq;
+		event.stamp = (seq & sample_mask) == 0 ? lvldb::monotonic_ns() : 0;
+		memset(event.payload, seq, sizeof(event.payload));
+	}
+};
+
+// Reads every event, the last stages record the latency of the samples
+template<typename Fence>
+class handler_t: public lvldb::basic_task_t<Fence, handler_t<Fence>>
+{
+	public:
+
+	handler_t(Fence &fence, lvldb::histogram_t *latency):
+		lvldb::basic_task_t<Fence, handler_t>(fence, batch),
+		latency_(latency),
+		checksum_(0)
+	{ }
+
+	void process_slot(typename Fence::slot_t &event)
+	{
+		assert(event.seq == this->seq());
+
+		checksum_ += event.payload[0] + event.payload[sizeof(event.payload) - 1];
+
+		if (latency_ != nullptr && event.stamp != 0)
+			latency_->record(lvldb::monotonic_ns() - event.stamp);
+	}
+
+	private:
+
+	lvldb::histogram_t *latency_;
+	volatile long       checksum_;
+};
+
+template<size_t Size, typename Wait>
+void bench_topology(const std::string &topology, const std::string &wait,
+		    size_t ring, int secs)
+{
+	typedef lvldb::disruptor_t<event_t<Size>>       disruptor_t;
+	typedef lvldb::pipeline_t<disruptor_t, Wait>    pipeline_t;
+	typedef typename pipeline_t::fence_type         fence_t;
+	typedef publisher_t<fence_t>                    publisher_t;
+	typedef handler_t<fence_t>                      handler_t;
+
+	pipeline_t                            pipeline(ring, lvldb::ring_huge_pages |
+							 lvldb::ring_prefault);
+	std::unique_ptr<lvldb::histogram_t[]> latencies(new lvldb::histogram_t[3]);
+	lvldb::histogram_t                    latency;
+	size_t                                producer = pipeline.add_stage();
+
+	if (topology == "unicast") {
+		size_t sink = pipeline.add_stage({producer});
+
+		pipeline.template add_task<publisher_t>(producer);
+		pipeline.template add_task<handler_t>(sink, &latencies[0]);
+	} else if (topology == "pipeline") {
+		size_t first  = pipeline.add_stage({producer});
+		size_t second = pipeline.add_stage({first});
+		size_t sink   = pipeline.add_stage({second});
+
+		pipeline.template add_task<publisher_t>(producer);
+		pipeline.template add_task<handler_t>(first, nullptr);
+		pipeline.template add_task<handler_t>(second, nullptr);
+		pipeline.template add_task<handler_t>(sink, &latencies[0]);
+	} else if (topology == "diamond") {
+		size_t left  = pipeline.add_stage({producer});
+		size_t right = pipeline.add_stage({producer});
+		size_t sink  = pipeline.add_stage({left, right});
+
+		pipeline.template add_task<publisher_t>(producer);
+		pipeline.template add_task<handler_t>(left, nullptr);
+		pipeline.template add_task<handler_t>(right, nullptr);
+		pipeline.template add_task<handler_t>(sink, &latencies[0]);
+	} else if (topology == "fanout") {
+		pipeline.template add_task<publisher_t>(producer);
+
+		for (int i = 0; i < 3; i++)
+			pipeline.template add_task<handler_t>(pipeline.add_stage({producer}),
+							      &latencies[i]);
+	} else if (topology == "multi") {
+		size_t sink = pipeline.add_stage({producer});
+
+		for (int i = 0; i < 3; i++)
+			pipeline.template add_task<publisher_t>(producer);
+
+		pipeline.template add_task<handler_t>(sink, &latencies[0]);
+	}
+
+	pipeline.build();
+
+	double wall = now();
+
+	pipeline.start();
+	sleep(secs);
+	pipeline.stop();
+
+	wall = now() - wall;
+
+	for (int i = 0; i < 3; i++)
+		latency.add(latencies[i]);
+
+	lvldb::seq_t events = pipeline.fence(producer).cursor();
+
+	std::cout << topology << "," << wait << "," << ring << "," << Size << ","
+		  << events << "," << static_cast<long>(events / wall) << ","
+		  << latency.percentile(0.5) << "," << latency.percentile(0.9) << ","
+		  << latency.percentile(0.99) << "," << latency.percentile(0.999) << ","
+		  << latency.percentile(1) << std::endl;
+}
+
+template<typename Wait>
+void bench_wait(const std::string &wait, const std::string &topology, int secs)
+{
+	const char   *topologies[] = {"unicast", "pipeline", "diamond", "fanout", "multi"};
+	const size_t  rings[]      = {64, 1024, 65536};
+
+	for (const char *name : topologies) {
+		if (topology != "all" && topology != name)
+			continue;
+
+		for (size_t ring : rings) {
+			bench_topology<32, Wait>(name, wait, ring, secs);
+			bench_topology<128, Wait>(name, wait, ring, secs);
+			bench_topology<512, Wait>(name, wait, ring, secs);
+		}
+	}
+}
+
+void bench_suite(int secs, const std::string &topology, const std::string &wait)
+{
+	std::cout << "topology,wait,ring,slot,events,ops_per_sec,"
+		  << "latency_p50_ns,latency_p90_ns,latency_p99_ns,"
+		  << "latency_p999_ns,latency_max_ns" << std::endl;
+
+	if (wait == "all" || wait == "spin")
+		bench_wait<lvldb::busy_spin_wait_t>("spin", topology, secs);
+	if (wait == "all" || wait == "yield")
+		bench_wait<lvldb::yield_wait_t>("yield", topology, secs);
+	if (wait == "all" || wait == "sleep")
+		bench_wait<lvldb::sleep_wait_t>("sleep", topology, secs);
+	if (wait == "all" || wait == "block")
+		bench_wait<lvldb::blocking_wait_t>("block", topology, secs);
+	if (wait == "all" || wait == "adaptive")
+		bench_wait<lvldb::adaptive_wait_t>("adaptive", topology, secs);
+}
+
+void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " rates <disruptor size> <seconds>"
+		  << " [<producer cpu> <consumer cpu>]\n"
+		  << "       " << name << " suite <seconds>"
+		  << " [unicast|pipeline|diamond|fanout|multi|all"
+		  << " [spin|yield|sleep|block|adaptive|all]]\n";
+
+	exit(EXIT_FAILURE);
+}
+
+// Both reports are CSV on stdout
+int main(int argc, char *argv[])
+{
+	std::string mode = argc > 1 ? argv[1] : "";
+
+	if (mode == "rates" && (argc == 4 || argc == 6)) {
+		size_t size    = std::stoi(argv[2]);
+		int    secs    = std::stoi(argv[3]);
+		int    cpus[2] = {-1, -1};
+
+		if (argc == 6) {
+			cpus[0] = std::stoi(argv[4]);
+			cpus[1] = std::stoi(argv[5]);
+		}
+
+		bench_rates(size, secs, cpus);
+	} else if (mode == "suite" && argc >= 3 && argc <= 5)
+		bench_suite(std::stoi(argv[2]), argc > 3 ? argv[3] : "all",
+			    argc > 4 ? argv[4] : "all");
+	else
+		usage(argv[0]);
+
+	return 0;
+}
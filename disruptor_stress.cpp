@@ -0,0 +1,145 @@
+#include <iostream>
+#include <string>
+
+#include "pipeline.hpp"
+
+// Checks the memory orderings of the fences: every stage reads what the
+// previous ones wrote to a slot and producers only overwrite a slot
+// once the last stage is done with it. Tiny rings keep every slot under
+// contention, and the checks stay on in optimized builds.
+
+const size_t payload = 8;
+
+struct event_t
+{
+	lvldb::seq_t words[payload];
+	lvldb::seq_t left;
+	lvldb::seq_t right;
+	lvldb::seq_t done;
+};
+
+void check(bool ok, const char *what, lvldb::seq_t seq)
+{
+	if (!ok) {
+		fprintf(stderr, "stress: %s at seq %lu\n", what, seq);
+		abort();
+	}
+}
+
+template<typename Fence>
+class producer_t: public lvldb::basic_task_t<Fence, producer_t<Fence>>
+{
+	public:
+
+	producer_t(Fence &fence, size_t size):
+		lvldb::basic_task_t<Fence, producer_t>(fence, 4),
+		size_(size)
+	{ }
+
+	void process_slot(event_t &event)
+	{
+		lvldb::seq_t seq = this->seq();
+
+		// Values are seq + 1, untouched slots are zeroed
+		check(event.done == (seq < size_ ? 0 : seq - size_ + 1), "slot reused early", seq);
+
+		for (size_t i = 0; i < payload; i++)
+			event.words[i] = seq + 1;
+	}
+
+	private:
+
+	const size_t size_;
+};
+
+template<typename Fence, lvldb::seq_t event_t::*Field>
+class handler_t: public lvldb::basic_task_t<Fence, handler_t<Fence, Field>>
+{
+	public:
+
+	handler_t(Fence &fence):
+		lvldb::basic_task_t<Fence, handler_t>(fence, 2)
+	{ }
+
+	void process_slot(event_t &event)
+	{
+		lvldb::seq_t seq = this->seq();
+
+		for (size_t i = 0; i < payload; i++)
+			check(event.words[i] == seq + 1, "stale word", seq);
+
+		event.*Field = seq + 1;
+	}
+};
+
+template<typename Fence>
+class join_t: public lvldb::basic_task_t<Fence, join_t<Fence>>
+{
+	public:
+
+	join_t(Fence &fence):
+		lvldb::basic_task_t<Fence, join_t>(fence, 3)
+	{ }
+
+	void process_slot(event_t &event)
+	{
+		lvldb::seq_t seq = this->seq();
+
+		check(event.left == seq + 1 && event.right == seq + 1, "stale stage", seq);
+
+		event.done = seq + 1;
+	}
+};
+
+// Two producers, a left stage split between two tasks and a right one,
+// then a join
+template<typename Wait>
+void stress(const std::string &wait, size_t size, int secs)
+{
+	typedef lvldb::disruptor_t<event_t>          disruptor_t;
+	typedef lvldb::pipeline_t<disruptor_t, Wait> pipeline_t;
+	typedef typename pipeline_t::fence_type      fence_t;
+
+	pipeline_t pipeline(size);
+	size_t     producer = pipeline.add_stage();
+	size_t     left     = pipeline.add_stage({producer});
+	size_t     right    = pipeline.add_stage({producer});
+	size_t     join     = pipeline.add_stage({left, right});
+
+	pipeline.template add_task<producer_t<fence_t>>(producer, size);
+	pipeline.template add_task<producer_t<fence_t>>(producer, size);
+	pipeline.template add_task<handler_t<fence_t, &event_t::left>>(left);
+	pipeline.template add_task<handler_t<fence_t, &event_t::left>>(left);
+	pipeline.template add_task<handler_t<fence_t, &event_t::right>>(right);
+	pipeline.template add_task<join_t<fence_t>>(join);
+
+	pipeline.build();
+	pipeline.start();
+	sleep(secs);
+	pipeline.stop();
+
+	check(pipeline.fence(join).cursor() == pipeline.fence(producer).cursor(),
+	      "events left behind", pipeline.fence(join).cursor());
+
+	std::cerr << wait << " size " << size << ": "
+		  << pipeline.fence(producer).cursor() << " events" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		std::cerr << "Usage: " << argv[0] << " <seconds per run>\n";
+
+		return EXIT_FAILURE;
+	}
+
+	int secs = std::stoi(argv[1]);
+
+	for (size_t size : {1, 2, 4, 64}) {
+		stress<lvldb::yield_wait_t>("yield", size, secs);
+		stress<lvldb::adaptive_wait_t>("adaptive", size, secs);
+		stress<lvldb::busy_spin_wait_t>("spin", size, secs);
+	}
+
+	return 0;
+}
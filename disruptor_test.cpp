@@ -1,14 +1,17 @@
 #include <iostream>
+#include <thread>
 
 #include "disruptor.hpp"
 
+typedef lvldb::disruptor_t<long> disruptor_t;
+
 template<typename Fence>
-class task1_t: public lvldb::task_t<Fence>
+class task1_t: public lvldb::basic_task_t<Fence, task1_t<Fence>>
 {
 	public:
 
-	task1_t(Fence &fence, int acquire_slot_directly):
-		lvldb::task_t<Fence>(fence, acquire_slot_directly),
+	task1_t(Fence &fence, size_t max_batch = 1):
+		lvldb::basic_task_t<Fence, task1_t>(fence, max_batch),
 		initialized_(false)
 	{ }
 
@@ -34,7 +37,7 @@ class task1_t: public lvldb::task_t<Fence>
 
 	void stop()
 	{
-		lvldb::task_t<Fence>::stop();
+		lvldb::basic_task_t<Fence, task1_t>::stop();
 		std::cerr << "finished task 1 seq = " << this->seq() << std::endl;
 	}
 
@@ -48,8 +51,8 @@ class task2_t: public lvldb::task_t<Fence>
 {
 	public:
 
-	task2_t(Fence &fence, int acquire_slot_directly):
-		lvldb::task_t<Fence>(fence, acquire_slot_directly)
+	task2_t(Fence &fence, size_t max_batch = 1):
+		lvldb::task_t<Fence>(fence, max_batch)
 	{ }
 
 	void process_slot(typename Fence::slot_t &slot)
@@ -81,8 +84,8 @@ class task3_t: public lvldb::task_t<Fence>
 {
 	public:
 
-	task3_t(Fence &fence, int acquire_slot_directly):
-		lvldb::task_t<Fence>(fence, acquire_slot_directly)
+	task3_t(Fence &fence, size_t max_batch = 1):
+		lvldb::task_t<Fence>(fence, max_batch)
 	{ }
 
 	void process_slot(typename Fence::slot_t &slot)
@@ -114,8 +117,8 @@ class task4_t: public lvldb::task_t<Fence>
 {
 	public:
 
-	task4_t(Fence &fence, int acquire_slot_directly):
-		lvldb::task_t<Fence>(fence, acquire_slot_directly)
+	task4_t(Fence &fence, size_t max_batch = 1):
+		lvldb::task_t<Fence>(fence, max_batch)
 	{ }
 
 	void process_slot(typename Fence::slot_t &slot)
@@ -143,45 +146,127 @@ class task4_t: public lvldb::task_t<Fence>
 	}
 };
 
-int main(int argc, char *argv[])
+// Writes a record of seq % 61 bytes for every sequence
+template<typename Fence>
+class writer_t: public lvldb::basic_task_t<Fence, writer_t<Fence>>
 {
-	typedef lvldb::disruptor_t<long>           disruptor_t;
-	typedef lvldb::atomic_fence_t<disruptor_t> fence_t;
+	public:
 
-	typedef task1_t<fence_t> task1_t;
-	typedef task2_t<fence_t> task2_t;
-	typedef task3_t<fence_t> task3_t;
-	typedef task4_t<fence_t> task4_t;
+	writer_t(Fence &fence, lvldb::arena_t &arena):
+		lvldb::basic_task_t<Fence, writer_t>(fence, 8),
+		fence_(fence),
+		arena_(arena)
+	{ }
 
-	if (argc != 2) {
-		std::cerr << "Usage: " << argv[0] << " <disruptor size>\n";
+	void process_slot(typename Fence::slot_t &slot)
+	{
+		lvldb::seq_t    seq    = this->seq();
+		lvldb::record_t record = arena_.allocate(seq, seq % 61, fence_,
+							 this->batch_seq());
 
-		return EXIT_FAILURE;
+		for (size_t i = 0; i < record.size; i++)
+			record.data[i] = seq + i;
+
+		slot = seq * 4;
+	}
+
+	private:
+
+	Fence          &fence_;
+	lvldb::arena_t &arena_;
+};
+
+template<typename Fence>
+class reader_t: public lvldb::basic_task_t<Fence, reader_t<Fence>>
+{
+	public:
+
+	reader_t(Fence &fence, lvldb::arena_t &arena):
+		lvldb::basic_task_t<Fence, reader_t>(fence, 4),
+		arena_(arena)
+	{ }
+
+	void process_slot(typename Fence::slot_t &slot)
+	{
+		lvldb::seq_t    seq    = this->seq();
+		lvldb::record_t record = arena_.record(seq);
+
+		assert(static_cast<lvldb::seq_t>(slot) == seq * 4);
+		assert(record.size == seq % 61);
+
+		for (size_t i = 0; i < record.size; i++)
+			assert(record.data[i] == static_cast<char>(seq + i));
+
+		slot = seq * 4 + 1;
+	}
+
+	void stop()
+	{
+		lvldb::basic_task_t<Fence, reader_t>::stop();
+		std::cerr << "finished reader seq = " << this->seq() << std::endl;
 	}
 
-	disruptor_t d(std::stoi(argv[1]));
-	fence_t     f1(d, fence_t::producer);
-	fence_t     f2(d, fence_t::consumer);
-	fence_t     f3(d, fence_t::consumer);
+	private:
 
-	task1_t t1(f1, 2);
-	sleep(1); // XXX: Algo como un mutex y una cond!
-	task2_t t2(f2, 1);
-	sleep(1);
-	task3_t t3(f2, 1);
-	sleep(1);
-	task4_t t4(f3, 1);
+	lvldb::arena_t &arena_;
+};
+
+#ifdef LVLDB_STATS
+template<typename Fence>
+void print_stats(const char *name, const Fence &fence)
+{
+	lvldb::task_stats_t stats;
+
+	fence.stats(stats);
+
+	std::cerr << name << ": claims = " << stats.claims.get()
+		  << " retries = "      << stats.retries.get()
+		  << " slots = "        << stats.slots.get()
+		  << " spins = "        << stats.spins.get()
+		  << " yields = "       << stats.yields.get()
+		  << " sleeps = "       << stats.sleeps.get()
+		  << " parks = "        << stats.parks.get() << std::endl;
+	std::cerr << name << ": batch p50 = " << stats.batches.percentile(0.5)
+		  << " occupancy p50 = " << stats.occupancy.percentile(0.5)
+		  << " latency p50 = "   << stats.latency.percentile(0.5)
+		  << " p99 = "           << stats.latency.percentile(0.99)
+		  << " max = "           << stats.latency.percentile(1) << " ns"
+		  << std::endl;
+}
+#endif
+
+template<typename Fence, typename SingleFence,
+	 typename ProducerFence = SingleFence>
+void run_pipeline(size_t size, int producers = 1)
+{
+	typedef Fence         fence_t;
+	typedef SingleFence   single_fence_t;
+	typedef ProducerFence producer_fence_t;
+
+	typedef task1_t<producer_fence_t> task1_t;
+	typedef task2_t<fence_t>        task2_t;
+	typedef task3_t<fence_t>        task3_t;
+	typedef task4_t<single_fence_t> task4_t;
+
+	disruptor_t    d(size, lvldb::ring_huge_pages | lvldb::ring_prefault |
+				  lvldb::ring_line_slots);
+	producer_fence_t f1(d, fence_t::producer);
+	fence_t          f2(d, fence_t::consumer);
+	single_fence_t   f3(d, fence_t::consumer);
+
+	task1_t t1(f1, 8);
+	std::unique_ptr<task1_t> t1b(producers > 1 ? new task1_t(f1, 8) : nullptr);
+	task2_t t2(f2, 4);
+	task3_t t3(f2);
+	task4_t t4(f3, 16);
 
 	f3.set_next_fence(&f2);
 	f2.set_next_fence(&f1);
 	f1.set_next_fence(&f3);
 
-	f1.add_task(t1);
-	f2.add_task(t2);
-	f2.add_task(t3);
-	f3.add_task(t4);
-
 	t1.start();
+	if (t1b)
+		t1b->start();
 	t2.start();
 	t3.start();
 	t4.start();
@@ -189,9 +274,242 @@ int main(int argc, char *argv[])
 	sleep(10);
 
 	t1.stop();
+	if (t1b)
+		t1b->stop();
 	t2.stop();
 	t3.stop();
 	t4.stop();
 
+	// Nothing published by the producers was left behind
+	assert(f2.cursor() == f1.cursor());
+	assert(f3.cursor() == f1.cursor());
+
+#ifdef LVLDB_STATS
+	print_stats("fence 1", f1);
+	print_stats("fence 2", f2);
+	print_stats("fence 3", f3);
+#endif
+}
+
+template<typename Wait>
+void run_atomic_pipeline(size_t size)
+{
+	run_pipeline<lvldb::atomic_fence_t<disruptor_t, lvldb::multi_writer_t, Wait>,
+		     lvldb::atomic_fence_t<disruptor_t, lvldb::single_writer_t, Wait>>(size);
+}
+
+// Mutex fences in between atomic ones, which notify the mutex fences
+// gating on them
+void run_mixed_pipeline(size_t size)
+{
+	run_pipeline<lvldb::mutex_fence_t<disruptor_t>,
+		     lvldb::atomic_fence_t<disruptor_t, lvldb::single_writer_t,
+					   lvldb::sleep_wait_t>>(size);
+}
+
+// Two producers publishing out of order
+template<typename Wait>
+void run_multi_producer_pipeline(size_t size)
+{
+	run_pipeline<lvldb::atomic_fence_t<disruptor_t, lvldb::multi_writer_t, Wait>,
+		     lvldb::atomic_fence_t<disruptor_t, lvldb::single_writer_t, Wait>,
+		     lvldb::atomic_fence_t<disruptor_t, lvldb::multi_producer_t, Wait>>(size, 2);
+}
+
+// A timed acquire on a full ring gives up soon after its deadline, even
+// with a wait strategy sleeping much longer
+template<typename Wait>
+void check_timed_acquire(size_t size)
+{
+	typedef lvldb::atomic_fence_t<disruptor_t, lvldb::multi_producer_t, Wait> fence_t;
+	typedef lvldb::atomic_fence_t<disruptor_t, lvldb::single_writer_t, Wait>  single_fence_t;
+
+	disruptor_t                 d(size);
+	fence_t                     f1(d, fence_t::producer);
+	single_fence_t              f2(d, fence_t::consumer);
+	task2_t<single_fence_t>     t2(f2);
+	lvldb::publisher_t<fence_t> p(f1);
+
+	f1.set_next_fence(&f2);
+	f2.set_next_fence(&f1);
+
+	while (p.try_acquire(size) > 0) {
+		for (size_t i = 0; i < size; i++)
+			p[p.seq() + i] = (p.seq() + i) * 4;
+
+		p.publish();
+	}
+
+	uint64_t start   = lvldb::monotonic_ns();
+	size_t   count   = p.acquire(1, start + 1000 * 1000);
+	uint64_t elapsed = lvldb::monotonic_ns() - start;
+
+	assert(count == 0);
+	assert(elapsed >= 1000 * 1000 && elapsed < 20 * 1000 * 1000);
+	(void) count;
+	(void) elapsed;
+
+	t2.start();
+	f1.halt();
+	t2.stop();
+}
+
+// Application threads publishing with try_acquire() and a deadline
+// instead of a producer task
+template<typename Wait>
+void run_publisher_pipeline(size_t size)
+{
+	typedef lvldb::atomic_fence_t<disruptor_t, lvldb::multi_producer_t, Wait> fence_t;
+	typedef lvldb::atomic_fence_t<disruptor_t, lvldb::single_writer_t, Wait>  single_fence_t;
+
+	disruptor_t                 d(size);
+	fence_t                     f1(d, fence_t::producer);
+	single_fence_t              f2(d, fence_t::consumer);
+	task2_t<single_fence_t>     t2(f2, 4);
+	lvldb::publisher_t<fence_t> p(f1);
+	std::atomic<bool>           done(false);
+	std::atomic<long>           shed(0);
+
+	f1.set_next_fence(&f2);
+	f2.set_next_fence(&f1);
+
+	// Nothing consumes yet, so the ring fills up and then gives up
+	for (size_t i = 0; i < size; i++) {
+		size_t count = p.try_acquire();
+
+		assert(count == 1);
+		(void) count;
+
+		p[p.seq()] = p.seq() * 4;
+		p.publish();
+	}
+
+	uint64_t deadline = lvldb::monotonic_ns() + 50 * 1000 * 1000;
+	size_t   tried    = p.try_acquire();
+	size_t   timed    = p.acquire(1, deadline);
+
+	assert(tried == 0 && timed == 0);
+	assert(lvldb::monotonic_ns() >= deadline);
+	(void) tried;
+	(void) timed;
+
+	t2.start();
+
+	auto publish = [&](bool timed) {
+		lvldb::publisher_t<fence_t> p(f1);
+
+		while (!done) {
+			size_t count = timed ?
+				p.acquire(4, lvldb::monotonic_ns() + 1000 * 1000) :
+				p.try_acquire(4);
+
+			if (count == 0) {
+				shed++;
+				continue;
+			}
+
+			for (size_t i = 0; i < count; i++)
+				p[p.seq() + i] = (p.seq() + i) * 4;
+
+			p.publish();
+		}
+	};
+
+	std::thread p1(publish, false);
+	std::thread p2(publish, true);
+
+	sleep(10);
+
+	done = true;
+	p1.join();
+	p2.join();
+
+	f1.halt();
+	t2.stop();
+
+	std::cerr << "shed " << shed << " acquires" << std::endl;
+
+	// Nothing published was left behind
+	assert(f2.cursor() == f1.cursor());
+}
+
+// Variable length records through an arena smaller than the records
+// the ring can hold, so producers wait for room
+template<typename ProducerFence, typename ConsumerFence>
+void run_arena_pipeline(size_t size)
+{
+	disruptor_t             d(size, 0, -1, 1024);
+	ProducerFence           f1(d, ProducerFence::producer);
+	ConsumerFence           f2(d, ConsumerFence::consumer);
+	writer_t<ProducerFence> writer(f1, d.arena());
+	reader_t<ConsumerFence> reader(f2, d.arena());
+
+	f1.set_next_fence(&f2);
+	f2.set_next_fence(&f1);
+
+	writer.start();
+	reader.start();
+
+	sleep(10);
+
+	writer.stop();
+	reader.stop();
+
+	// Nothing published by the writer was left behind
+	assert(f2.cursor() == f1.cursor());
+}
+
+int main(int argc, char *argv[])
+{
+	std::string wait = argc == 3 ? argv[2] : "sleep";
+
+	if (argc < 2 || argc > 3) {
+		std::cerr << "Usage: " << argv[0] << " <disruptor size>"
+			  << " [spin|yield|sleep|block|adaptive|mutex|mixed|multi|publisher|arena]\n";
+
+		return EXIT_FAILURE;
+	}
+
+	size_t size = std::stoi(argv[1]);
+
+	if (wait == "spin")
+		run_atomic_pipeline<lvldb::busy_spin_wait_t>(size);
+	else if (wait == "yield")
+		run_atomic_pipeline<lvldb::yield_wait_t>(size);
+	else if (wait == "sleep")
+		run_atomic_pipeline<lvldb::sleep_wait_t>(size);
+	else if (wait == "block")
+		run_atomic_pipeline<lvldb::blocking_wait_t>(size);
+	else if (wait == "adaptive")
+		run_atomic_pipeline<lvldb::adaptive_wait_t>(size);
+	else if (wait == "mutex")
+		run_pipeline<lvldb::mutex_fence_t<disruptor_t>,
+			     lvldb::mutex_fence_t<disruptor_t>>(size);
+	else if (wait == "mixed")
+		run_mixed_pipeline(size);
+	else if (wait == "multi")
+		run_multi_producer_pipeline<lvldb::blocking_wait_t>(size);
+	else if (wait == "publisher") {
+		check_timed_acquire<lvldb::blocking_wait_t>(size);
+		check_timed_acquire<lvldb::adaptive_wait_t>(size);
+		check_timed_acquire<lvldb::sleep_wait_t>(size);
+		run_publisher_pipeline<lvldb::adaptive_wait_t>(size);
+	}
+	else if (wait == "arena") {
+		typedef lvldb::atomic_fence_t<disruptor_t, lvldb::single_writer_t,
+					      lvldb::blocking_wait_t> blocking_fence_t;
+		typedef lvldb::atomic_fence_t<disruptor_t, lvldb::single_writer_t,
+					      lvldb::adaptive_wait_t> adaptive_fence_t;
+
+		run_arena_pipeline<blocking_fence_t, blocking_fence_t>(size);
+		run_arena_pipeline<adaptive_fence_t, adaptive_fence_t>(size);
+		run_arena_pipeline<lvldb::mutex_fence_t<disruptor_t>, blocking_fence_t>(size);
+	}
+	else {
+		std::cerr << "Unknown wait strategy: " << wait << "\n";
+
+		return EXIT_FAILURE;
+	}
+
 	return 0;
 }
@@ -0,0 +1,304 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include "disruptor.hpp"
+
+namespace lvldb
+{
+
+// Builds a disruptor, its fences and its tasks from a DAG of stages.
+// Each stage is a fence whose tasks share its sequences, and it comes
+// after one or more stages, joining them when there are several. The
+// first stage is the producer, it comes after no stage and gates on
+// the stages nothing comes after.
+//
+// Stages pick their fence with a factory, atomic_fences() with the
+// wait strategy of the pipeline by default. Atomic stages with a single
+// task get a single writer fence, the producer stage with several tasks
+// publishes out of order with multi_producer_t. Fences of any kind and
+// wait strategy can follow each other:
+//
+//	size_t audit = pipeline.add_stage({producer},
+//					  pipeline_type::mutex_fences());
+//	size_t sink  = pipeline.add_stage({producer},
+//					  pipeline_type::atomic_fences<busy_spin_wait_t>());
+//
+// The producer stage may have no task at all, other threads then
+// publish to it through publisher_fence() and must be done before the
+// pipeline is stopped.
+template<typename Disr, typename Wait = sleep_wait_t>
+class pipeline_t
+{
+	public:
+
+	typedef typename Disr::slot_t slot_t;
+
+	// Fence taken by the tasks of a pipeline, the actual one is only
+	// chosen once it is built
+	typedef lvldb::fence_t<Disr> fence_type;
+
+	// Fence of a producer stage without tasks
+	typedef atomic_fence_t<Disr, multi_producer_t, Wait> publisher_fence_type;
+
+	// Creates the fence of a stage from its type and its number of
+	// tasks once the pipeline is built
+	typedef std::function<fence_type *(Disr &, typename fence_type::type_t, size_t)>
+		fence_factory_t;
+
+	// Atomic fences with the claim policy their tasks need
+	template<typename Stage_wait>
+	static fence_factory_t atomic_fences(const Stage_wait &wait = Stage_wait())
+	{
+		return [wait](Disr &disruptor, typename fence_type::type_t type,
+			      size_t tasks) -> fence_type * {
+			// Publishers need the producer fence to gate on what
+			// they published, since they claim no slot while idle
+			if (tasks == 1)
+				return new atomic_fence_t<Disr, single_writer_t, Stage_wait>(disruptor, type, wait);
+			else if (type == fence_type::producer)
+				return new atomic_fence_t<Disr, multi_producer_t, Stage_wait>(disruptor, type, wait);
+			else
+				return new atomic_fence_t<Disr, multi_writer_t, Stage_wait>(disruptor, type, wait);
+		};
+	}
+
+	static fence_factory_t mutex_fences()
+	{
+		return [](Disr &disruptor, typename fence_type::type_t type,
+			  size_t) -> fence_type * {
+			return new mutex_fence_t<Disr>(disruptor, type);
+		};
+	}
+
+	pipeline_t(size_t size, int flags = 0, int numa_node = -1,
+		   const Wait &wait = Wait()):
+		size_(size),
+		flags_(flags),
+		numa_node_(numa_node),
+		wait_(wait),
+		built_(false),
+		running_(false)
+	{ }
+
+	pipeline_t(const pipeline_t &) = delete;
+	pipeline_t &operator=(const pipeline_t &) = delete;
+
+	~pipeline_t()
+	{
+		if (running_)
+			stop();
+	}
+
+	// A stage can only come after stages already added, so the graph
+	// has no cycles and stages are numbered in topological order.
+	// Without a factory the stage gets the fences of the pipeline.
+	size_t add_stage(const std::vector<size_t> &after = {},
+			 const fence_factory_t &fences = nullptr)
+	{
+		check(!built_, "stage added to a built pipeline");
+		check(stages_.empty() == after.empty(),
+		      "only the first stage comes after no stage");
+
+		for (size_t i = 0; i < after.size(); i++) {
+			check(after[i] < stages_.size(), "stage after an unknown stage");
+			check(std::count(after.begin(), after.end(), after[i]) == 1,
+			      "stage after the same stage twice");
+		}
+
+		stages_.push_back(stage_t());
+		stages_.back().after  = after;
+		stages_.back().fences = fences;
+
+		return stages_.size() - 1;
+	}
+
+	// The task is created with the fence of the stage followed by args
+	// when the pipeline is built
+	template<typename Task, typename... Args>
+	void add_task(size_t stage, Args... args)
+	{
+		check(!built_, "task added to a built pipeline");
+		check(stage < stages_.size(), "task added to an unknown stage");
+
+		stages_[stage].tasks.push_back([=](fence_type &fence) {
+			return new task_holder_t<Task>(fence, args...);
+		});
+	}
+
+	void build()
+	{
+		check(!built_, "pipeline built twice");
+		check(stages_.size() > 1, "pipeline without consumer stages");
+
+		for (size_t i = 1; i < stages_.size(); i++)
+			check(!stages_[i].tasks.empty(), "consumer stage without tasks");
+
+		check(!stages_[0].tasks.empty() || !stages_[0].fences,
+		      "producer stage without tasks given a fence factory");
+
+		disruptor_.reset(new Disr(size_, flags_, numa_node_));
+
+		for (size_t i = 0; i < stages_.size(); i++)
+			fences_.emplace_back(make_fence(stages_[i], i == 0 ?
+							fence_type::producer :
+							fence_type::consumer));
+
+		for (size_t i = 1; i < stages_.size(); i++) {
+			for (size_t after : stages_[i].after)
+				fences_[i]->add_next_fence(fences_[after].get());
+
+			if (is_last(i))
+				fences_[0]->add_next_fence(fences_[i].get());
+		}
+
+		// Every task is waiting for start() before any starts
+		for (size_t i = 0; i < stages_.size(); i++) {
+			for (const task_factory_t &factory : stages_[i].tasks)
+				tasks_.emplace_back(factory(*fences_[i]));
+		}
+
+		built_ = true;
+	}
+
+	void start()
+	{
+		check(built_ && !running_, "pipeline not built or already running");
+
+		for (const std::unique_ptr<task_base_t> &task : tasks_)
+			task->start();
+
+		running_ = true;
+	}
+
+	// Stops the tasks in stage order, so every stage drains what its
+	// previous stages published
+	void stop()
+	{
+		check(running_, "pipeline not running");
+
+		if (stages_[0].tasks.empty())
+			fences_[0]->halt();
+
+		for (const std::unique_ptr<task_base_t> &task : tasks_)
+			task->stop();
+
+		running_ = false;
+	}
+
+	Disr &disruptor()
+	{
+		return *disruptor_;
+	}
+
+	fence_type &fence(size_t stage)
+	{
+		return *fences_[stage];
+	}
+
+	const fence_type &fence(size_t stage) const
+	{
+		return *fences_[stage];
+	}
+
+	publisher_fence_type &publisher_fence()
+	{
+		check(built_ && stages_[0].tasks.empty(), "producer stage with tasks");
+
+		return static_cast<publisher_fence_type &>(*fences_[0]);
+	}
+
+	size_t stages() const
+	{
+		return stages_.size();
+	}
+
+	private:
+
+	struct task_base_t
+	{
+		virtual ~task_base_t() { }
+		virtual void start() = 0;
+		virtual void stop() = 0;
+	};
+
+	template<typename Task>
+	struct task_holder_t: public task_base_t
+	{
+		template<typename... Args>
+		task_holder_t(fence_type &fence, Args... args):
+			task(fence, args...)
+		{ }
+
+		void start()
+		{
+			task.start();
+		}
+
+		void stop()
+		{
+			task.stop();
+		}
+
+		Task task;
+	};
+
+	typedef std::function<task_base_t *(fence_type &)> task_factory_t;
+
+	struct stage_t
+	{
+		std::vector<size_t>         after;
+		std::vector<task_factory_t> tasks;
+		fence_factory_t             fences;
+	};
+
+	const size_t                              size_;
+	const int                                 flags_;
+	const int                                 numa_node_;
+	const Wait                                wait_;
+	bool                                      built_;
+	bool                                      running_;
+	std::vector<stage_t>                      stages_;
+	std::unique_ptr<Disr>                     disruptor_;
+	std::vector<std::unique_ptr<fence_type>>  fences_;
+	std::vector<std::unique_ptr<task_base_t>> tasks_;
+
+	static void check(bool ok, const char *error)
+	{
+		if (!ok) {
+			fprintf(stderr, "pipeline: %s\n", error);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	bool is_last(size_t stage) const
+	{
+		for (const stage_t &other : stages_) {
+			if (std::count(other.after.begin(), other.after.end(), stage) > 0)
+				return false;
+		}
+
+		return true;
+	}
+
+	fence_type *make_fence(const stage_t &stage,
+			       typename fence_type::type_t type)
+	{
+		if (stage.tasks.empty())
+			return new publisher_fence_type(*disruptor_, type, wait_);
+		else if (stage.fences)
+			return stage.fences(*disruptor_, type, stage.tasks.size());
+		else
+			return atomic_fences(wait_)(*disruptor_, type, stage.tasks.size());
+	}
+};
+
+}
+
+#endif
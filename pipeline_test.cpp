@@ -0,0 +1,146 @@
+#include <iostream>
+
+#include "pipeline.hpp"
+
+struct event_t
+{
+	long value;
+	long left;
+	long right;
+	long done;
+};
+
+typedef lvldb::disruptor_t<event_t>      disruptor_t;
+typedef lvldb::pipeline_t<disruptor_t>   pipeline_t;
+typedef pipeline_t::fence_type           fence_t;
+
+// Every stage sees the whole previous round done by the join
+class producer_t: public lvldb::task_t<fence_t>
+{
+	public:
+
+	producer_t(fence_t &fence, size_t max_batch, size_t size):
+		lvldb::task_t<fence_t>(fence, max_batch),
+		size_(size)
+	{ }
+
+	private:
+
+	const size_t size_;
+
+	void process_slot(event_t &event)
+	{
+		lvldb::seq_t seq = this->seq();
+
+		assert(seq < size_ ? event.done == 0 :
+		       static_cast<size_t>(event.done) == seq - size_);
+		(void) seq;
+
+		event.value = this->seq();
+	}
+};
+
+class left_t: public lvldb::task_t<fence_t>
+{
+	public:
+
+	left_t(fence_t &fence):
+		lvldb::task_t<fence_t>(fence)
+	{ }
+
+	private:
+
+	void process_slot(event_t &event)
+	{
+		assert(static_cast<lvldb::seq_t>(event.value) == this->seq());
+
+		event.left = event.value * 2;
+	}
+};
+
+class right_t: public lvldb::task_t<fence_t>
+{
+	public:
+
+	right_t(fence_t &fence):
+		lvldb::task_t<fence_t>(fence, 4)
+	{ }
+
+	private:
+
+	void process_slot(event_t &event)
+	{
+		assert(static_cast<lvldb::seq_t>(event.value) == this->seq());
+
+		event.right = event.value * 3;
+	}
+};
+
+class join_t: public lvldb::task_t<fence_t>
+{
+	public:
+
+	join_t(fence_t &fence):
+		lvldb::task_t<fence_t>(fence, 16)
+	{ }
+
+	void stop()
+	{
+		lvldb::task_t<fence_t>::stop();
+		std::cerr << "finished join seq = " << this->seq() << std::endl;
+	}
+
+	private:
+
+	void process_slot(event_t &event)
+	{
+		assert(event.left == event.value * 2);
+		assert(event.right == event.value * 3);
+
+		event.done = event.value;
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		std::cerr << "Usage: " << argv[0] << " <disruptor size>\n";
+
+		return EXIT_FAILURE;
+	}
+
+	size_t     size = std::stoi(argv[1]);
+	pipeline_t pipeline(size);
+
+	// Diamond: two producers, then a left and a right stage seeing
+	// every event, the right one split between two tasks, then a join.
+	// The left stage sleeps on a mutex fence and the right one parks
+	// on futexes next to the sleeping fences of the others.
+	size_t producer = pipeline.add_stage();
+	size_t left     = pipeline.add_stage({producer}, pipeline_t::mutex_fences());
+	size_t right    = pipeline.add_stage({producer},
+					     pipeline_t::atomic_fences<lvldb::blocking_wait_t>());
+	size_t join     = pipeline.add_stage({left, right});
+
+	pipeline.add_task<producer_t>(producer, 8, size);
+	pipeline.add_task<producer_t>(producer, 8, size);
+	pipeline.add_task<left_t>(left);
+	pipeline.add_task<right_t>(right);
+	pipeline.add_task<right_t>(right);
+	pipeline.add_task<join_t>(join);
+
+	pipeline.build();
+	pipeline.start();
+
+	sleep(5);
+
+	pipeline.stop();
+
+	// Nothing published by the producers was left behind
+	for (size_t stage : {left, right, join}) {
+		assert(pipeline.fence(stage).cursor() == pipeline.fence(producer).cursor());
+		(void) stage;
+	}
+
+	return 0;
+}
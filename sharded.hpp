@@ -0,0 +1,195 @@
+#ifndef SHARDED_HPP
+#define SHARDED_HPP
+
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+
+#include "pipeline.hpp"
+#include "murmurhash/MurmurHash3.h"
+
+namespace lvldb
+{
+
+// Independent pipelines, the shards, with events routed to them by the
+// hash of a key. Claims on different shards never contend, so the
+// throughput grows with the shards as long as there are cores for
+// them. Events with the same key always go to the same shard, which
+// keeps their order for stages with a single task.
+//
+// Each shard is built like a pipeline whose producer stage has no
+// tasks, so it is fed by publishers from any thread:
+//
+//	sharded_t<Disr> sharded(4, 1024);
+//
+//	for (size_t i = 0; i < sharded.shards(); i++) {
+//		size_t stage = sharded.shard(i).add_stage({0});
+//
+//		sharded.shard(i).template add_task<Task>(stage);
+//	}
+//
+// Needs murmurhash/MurmurHash3.cpp to be linked.
+template<typename Disr, typename Wait = sleep_wait_t>
+class sharded_t
+{
+	public:
+
+	typedef typename Disr::slot_t                           slot_t;
+	typedef pipeline_t<Disr, Wait>                          pipeline_type;
+	typedef typename pipeline_type::publisher_fence_type    fence_type;
+
+	// Publishes to the shard of a key, one per thread like publisher_t,
+	// created once the shards are built
+	class publisher_t
+	{
+		public:
+
+		publisher_t(sharded_t &sharded):
+			sharded_(sharded),
+			shard_(0)
+		{
+			for (size_t i = 0; i < sharded_.shards(); i++)
+				publishers_.emplace_back(new lvldb::publisher_t<fence_type>(
+						sharded_.shard(i).publisher_fence()));
+		}
+
+		// The next calls claim slots from the shard of the key and
+		// return how many were claimed from seq(), 0 if it is halted
+
+		size_t try_acquire(const void *key, int len, size_t max_slots = 1)
+		{
+			shard_ = sharded_.route(key, len);
+
+			return publishers_[shard_]->try_acquire(max_slots);
+		}
+
+		size_t acquire(const void *key, int len, size_t max_slots, uint64_t deadline)
+		{
+			shard_ = sharded_.route(key, len);
+
+			return publishers_[shard_]->acquire(max_slots, deadline);
+		}
+
+		size_t acquire(const void *key, int len, size_t max_slots = 1)
+		{
+			shard_ = sharded_.route(key, len);
+
+			return publishers_[shard_]->acquire(max_slots);
+		}
+
+		// Shard of the last key
+		size_t shard() const
+		{
+			return shard_;
+		}
+
+		seq_t seq() const
+		{
+			return publishers_[shard_]->seq();
+		}
+
+		slot_t &operator[](seq_t seq)
+		{
+			return (*publishers_[shard_])[seq];
+		}
+
+		void publish()
+		{
+			publishers_[shard_]->publish();
+		}
+
+		private:
+
+		sharded_t                                                   &sharded_;
+		size_t                                                       shard_;
+		std::vector<std::unique_ptr<lvldb::publisher_t<fence_type>>> publishers_;
+	};
+
+	// Every shard gets its own ring of size slots, with an empty
+	// producer stage 0
+	sharded_t(size_t shards, size_t size, int flags = 0, int numa_node = -1,
+		  const Wait &wait = Wait(), uint32_t seed = 0):
+		seed_(seed)
+	{
+		if (shards == 0) {
+			fprintf(stderr, "sharded: no shards\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (size_t i = 0; i < shards; i++) {
+			shards_.emplace_back(new pipeline_type(size, flags, numa_node, wait));
+			shards_.back()->add_stage();
+		}
+	}
+
+	sharded_t(const sharded_t &) = delete;
+	sharded_t &operator=(const sharded_t &) = delete;
+
+	size_t shards() const
+	{
+		return shards_.size();
+	}
+
+	pipeline_type &shard(size_t shard)
+	{
+		return *shards_[shard];
+	}
+
+	const pipeline_type &shard(size_t shard) const
+	{
+		return *shards_[shard];
+	}
+
+	size_t route(const void *key, int len) const
+	{
+		uint64_t hash[2];
+
+		MurmurHash3_x64_128(key, len, seed_, hash);
+
+		return hash[0] % shards_.size();
+	}
+
+	void build()
+	{
+		for (const std::unique_ptr<pipeline_type> &shard : shards_)
+			shard->build();
+	}
+
+	void start()
+	{
+		for (const std::unique_ptr<pipeline_type> &shard : shards_)
+			shard->start();
+	}
+
+	// Publishers must be done with every shard
+	void stop()
+	{
+		for (const std::unique_ptr<pipeline_type> &shard : shards_)
+			shard->stop();
+	}
+
+	// Events published to the shard so far
+	seq_t events(size_t shard) const
+	{
+		return shards_[shard]->fence(0).min_seq();
+	}
+
+#ifdef LVLDB_STATS
+	// Adds up the stats of every task of the shard
+	void stats(size_t shard, task_stats_t &total) const
+	{
+		for (size_t i = 1; i < shards_[shard]->stages(); i++)
+			shards_[shard]->fence(i).stats(total);
+	}
+#endif
+
+	private:
+
+	const uint32_t                              seed_;
+	std::vector<std::unique_ptr<pipeline_type>> shards_;
+};
+
+}
+
+#endif
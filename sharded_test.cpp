@@ -0,0 +1,106 @@
+#include <iostream>
+#include <thread>
+#include <atomic>
+
+#include "sharded.hpp"
+
+struct event_t
+{
+	long key;
+	long count;
+};
+
+typedef lvldb::disruptor_t<event_t>      disruptor_t;
+typedef lvldb::sharded_t<disruptor_t>    sharded_t;
+typedef sharded_t::pipeline_type         pipeline_t;
+typedef pipeline_t::fence_type           fence_t;
+
+const int  publishers = 3;
+const long keys       = 64; // Per publisher
+
+// Sees the events of each key in the order they were published, and
+// only the keys of its shard
+class consumer_t: public lvldb::task_t<fence_t>
+{
+	public:
+
+	consumer_t(fence_t &fence, sharded_t *sharded, size_t shard):
+		lvldb::task_t<fence_t>(fence, 8),
+		sharded_(sharded),
+		shard_(shard),
+		counts_(publishers * keys, 0)
+	{ }
+
+	private:
+
+	sharded_t         *sharded_;
+	const size_t       shard_;
+	std::vector<long>  counts_;
+
+	void process_slot(event_t &event)
+	{
+		assert(sharded_->route(&event.key, sizeof(event.key)) == shard_);
+		assert(event.count == counts_[event.key]);
+
+		counts_[event.key]++;
+	}
+};
+
+void publish(sharded_t &sharded, int publisher, std::atomic<bool> &running)
+{
+	sharded_t::publisher_t writer(sharded);
+	std::vector<long>      counts(keys, 0);
+
+	for (long i = 0; running; i = (i + 1) % keys) {
+		long key = publisher * keys + i;
+
+		if (writer.acquire(&key, sizeof(key)) == 0)
+			continue;
+
+		event_t &event = writer[writer.seq()];
+
+		event.key   = key;
+		event.count = counts[i]++;
+		writer.publish();
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3) {
+		std::cerr << "Usage: " << argv[0] << " <disruptor size> <shards>\n";
+
+		return EXIT_FAILURE;
+	}
+
+	sharded_t                sharded(std::stoi(argv[2]), std::stoi(argv[1]));
+	std::atomic<bool>        running(true);
+	std::vector<std::thread> threads;
+
+	for (size_t i = 0; i < sharded.shards(); i++)
+		sharded.shard(i).add_task<consumer_t>(sharded.shard(i).add_stage({0}),
+						      &sharded, i);
+
+	sharded.build();
+	sharded.start();
+
+	for (int i = 0; i < publishers; i++)
+		threads.emplace_back(publish, std::ref(sharded), i, std::ref(running));
+
+	sleep(5);
+
+	running = false;
+
+	for (std::thread &thread : threads)
+		thread.join();
+
+	sharded.stop();
+
+	for (size_t i = 0; i < sharded.shards(); i++) {
+		assert(sharded.shard(i).fence(1).cursor() == sharded.events(i));
+
+		std::cerr << "shard " << i << " events = " << sharded.events(i) << std::endl;
+	}
+
+	return 0;
+}
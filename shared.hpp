@@ -0,0 +1,360 @@
+#ifndef SHARED_HPP
+#define SHARED_HPP
+
+#include <new>
+#include <string>
+#include <type_traits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "disruptor.hpp"
+
+namespace lvldb
+{
+
+// Named POSIX shared memory, mapped by the process creating it and by
+// the ones opening it afterwards. The creator removes the name when it
+// unmaps it, processes still mapping it keep the memory.
+class shared_memory_t
+{
+	public:
+
+	// Creates a zeroed segment of bytes, failing if the name is taken
+	shared_memory_t(const char *name, size_t bytes):
+		name_(name),
+		bytes_(bytes),
+		owner_(true)
+	{
+		int fd;
+
+		if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1) {
+			perror("shm_open");
+			exit(EXIT_FAILURE);
+		}
+
+		if (ftruncate(fd, bytes_) == -1) {
+			perror("ftruncate");
+			exit(EXIT_FAILURE);
+		}
+
+		map(fd);
+	}
+
+	// Opens a segment created by another process
+	explicit shared_memory_t(const char *name):
+		name_(name),
+		owner_(false)
+	{
+		struct stat st;
+		int         fd;
+
+		if ((fd = shm_open(name, O_RDWR, 0)) == -1) {
+			perror("shm_open");
+			exit(EXIT_FAILURE);
+		}
+
+		if (fstat(fd, &st) == -1) {
+			perror("fstat");
+			exit(EXIT_FAILURE);
+		}
+
+		bytes_ = st.st_size;
+		map(fd);
+	}
+
+	shared_memory_t(const shared_memory_t &) = delete;
+	shared_memory_t &operator=(const shared_memory_t &) = delete;
+
+	~shared_memory_t()
+	{
+		munmap(data_, bytes_);
+
+		if (owner_)
+			shm_unlink(name_.c_str());
+	}
+
+	inline char *data() const
+	{
+		return data_;
+	}
+
+	inline size_t size() const
+	{
+		return bytes_;
+	}
+
+	private:
+
+	const std::string  name_;
+	size_t             bytes_;
+	const bool         owner_;
+	char              *data_;
+
+	void map(int fd)
+	{
+		data_ = static_cast<char *>(mmap(nullptr, bytes_, PROT_READ | PROT_WRITE,
+		                                 MAP_SHARED, fd, 0));
+
+		if (data_ == MAP_FAILED) {
+			perror("mmap");
+			exit(EXIT_FAILURE);
+		}
+
+		close(fd);
+	}
+};
+
+// Ring whose slots and sequences live in a named shared memory segment,
+// so a producer in one process feeds a consumer in another without
+// copies through the kernel. The fences of a disruptor hold pointers
+// and virtual functions only valid in one process, so a shared ring has
+// a producer and a consumer end of its own, one of each. The consumer
+// can process the slots in place or forward them to a local pipeline.
+//
+// Slots are copied as plain bytes between processes, which may run
+// different binaries as long as they agree on the slot layout.
+template<typename Slot>
+class shared_disruptor_t
+{
+	public:
+
+	static_assert(std::is_trivially_copyable<Slot>::value,
+		      "shared slots must be trivially copyable");
+	static_assert(ATOMIC_LONG_LOCK_FREE == 2,
+		      "shared sequences must be lock free");
+
+	typedef Slot slot_t;
+
+	// Sequences and event counts of both ends
+	struct header_t
+	{
+		uint64_t                magic;
+		uint64_t                size;
+		uint64_t                slot_size;
+		padded_t<atomic_seq_t>  published; // Before it, readable
+		padded_t<atomic_seq_t>  released;  // Before it, writable again
+		padded_t<atomic_seq_t>  end;       // Set when the producer closes
+		padded_t<event_count_t> published_event;
+		padded_t<event_count_t> released_event;
+
+		header_t(size_t size):
+			magic(0),
+			size(size),
+			slot_size(sizeof(Slot)),
+			published(0),
+			released(0),
+			end(max_seq),
+			published_event(true),
+			released_event(true)
+		{ }
+	};
+
+	// Creates the segment, size must be a power of two
+	shared_disruptor_t(const char *name, size_t size):
+		memory_(name, slots_offset() + size * sizeof(Slot))
+	{
+		assert(size > 0 && (size & (size - 1)) == 0);
+
+		header_ = new (memory_.data()) header_t(size);
+
+		// Whoever sees the magic sees the rest of the header
+		std::atomic_thread_fence(std::memory_order_release);
+		header_->magic = shared_magic;
+		slots_ = reinterpret_cast<Slot *>(memory_.data() + slots_offset());
+	}
+
+	// Opens a segment created with the same slot type
+	explicit shared_disruptor_t(const char *name):
+		memory_(name)
+	{
+		header_ = reinterpret_cast<header_t *>(memory_.data());
+
+		if (memory_.size() < slots_offset() || header_->magic != shared_magic ||
+		    header_->slot_size != sizeof(Slot) ||
+		    memory_.size() < slots_offset() + header_->size * sizeof(Slot)) {
+			fprintf(stderr, "shared_disruptor: %s is not a ring of these slots\n", name);
+			exit(EXIT_FAILURE);
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		slots_ = reinterpret_cast<Slot *>(memory_.data() + slots_offset());
+	}
+
+	shared_disruptor_t(const shared_disruptor_t &) = delete;
+	shared_disruptor_t &operator=(const shared_disruptor_t &) = delete;
+
+	inline slot_t &operator[](seq_t seq)
+	{
+		return slots_[seq & (header_->size - 1)];
+	}
+
+	inline size_t size() const
+	{
+		return header_->size;
+	}
+
+	inline header_t &header()
+	{
+		return *header_;
+	}
+
+	private:
+
+	static const uint64_t shared_magic = 0x6c766c64626d6170; // "lvldbmap"
+
+	shared_memory_t  memory_;
+	header_t        *header_;
+	Slot            *slots_;
+
+	static size_t slots_offset()
+	{
+		return (sizeof(header_t) + max_line_size - 1) / max_line_size * max_line_size;
+	}
+};
+
+// Writes to a shared ring, from a single thread of a single process.
+// Notifies the consumer only with a blocking wait strategy, like a fence.
+template<typename Slot, typename Wait = sleep_wait_t>
+class shared_producer_t
+{
+	public:
+
+	typedef Slot slot_t;
+
+	shared_producer_t(shared_disruptor_t<Slot> &disruptor, const Wait &wait = Wait()):
+		disruptor_(disruptor),
+		header_(disruptor.header()),
+		wait_(wait),
+		seq_(header_.published.value),
+		count_(0)
+	{ }
+
+	// Waits for up to max_slots free slots from seq(), never 0
+	size_t acquire(size_t max_slots = 1)
+	{
+		seq_t room;
+
+		assert(count_ == 0 && max_slots > 0);
+
+		wait_.wait(header_.released_event.value, [this, &room]() {
+			room = header_.released.value.load(seq_acquire) + disruptor_.size() - seq_;
+
+			return room > 0;
+		});
+
+		return count_ = std::min<seq_t>(room, max_slots);
+	}
+
+	seq_t seq() const
+	{
+		return seq_;
+	}
+
+	slot_t &operator[](seq_t seq)
+	{
+		return disruptor_[seq];
+	}
+
+	void publish()
+	{
+		seq_ += count_;
+		count_ = 0;
+		header_.published.value.store(seq_, seq_release);
+
+		if (Wait::blocking)
+			header_.published_event.value.notify();
+	}
+
+	// Nothing else will be published, the consumer drains what was
+	void close()
+	{
+		assert(count_ == 0);
+
+		header_.end.value.store(seq_, seq_release);
+		header_.published_event.value.notify();
+	}
+
+	private:
+
+	typedef typename shared_disruptor_t<Slot>::header_t header_t;
+
+	shared_disruptor_t<Slot> &disruptor_;
+	header_t                 &header_;
+	const Wait                wait_;
+	seq_t                     seq_;
+	size_t                    count_;
+};
+
+// Reads from a shared ring, from a single thread of a single process
+template<typename Slot, typename Wait = sleep_wait_t>
+class shared_consumer_t
+{
+	public:
+
+	typedef Slot slot_t;
+
+	shared_consumer_t(shared_disruptor_t<Slot> &disruptor, const Wait &wait = Wait()):
+		disruptor_(disruptor),
+		header_(disruptor.header()),
+		wait_(wait),
+		seq_(header_.released.value),
+		count_(0)
+	{ }
+
+	// Waits for up to max_slots published slots from seq(), 0 once the
+	// producer closed the ring and everything was read
+	size_t acquire(size_t max_slots = 1)
+	{
+		seq_t ready;
+
+		assert(count_ == 0 && max_slots > 0);
+
+		wait_.wait(header_.published_event.value, [this, &ready]() {
+			ready = header_.published.value.load(seq_acquire) - seq_;
+
+			return ready > 0 || header_.end.value.load(seq_acquire) <= seq_;
+		});
+
+		return count_ = std::min<seq_t>(ready, max_slots);
+	}
+
+	seq_t seq() const
+	{
+		return seq_;
+	}
+
+	slot_t &operator[](seq_t seq)
+	{
+		return disruptor_[seq];
+	}
+
+	void release()
+	{
+		seq_ += count_;
+		count_ = 0;
+		header_.released.value.store(seq_, seq_release);
+
+		if (Wait::blocking)
+			header_.released_event.value.notify();
+	}
+
+	private:
+
+	typedef typename shared_disruptor_t<Slot>::header_t header_t;
+
+	shared_disruptor_t<Slot> &disruptor_;
+	header_t                 &header_;
+	const Wait                wait_;
+	seq_t                     seq_;
+	size_t                    count_;
+};
+
+}
+
+#endif
@@ -0,0 +1,145 @@
+#include <iostream>
+#include <string>
+
+#include <sys/wait.h>
+
+#include "shared.hpp"
+#include "pipeline.hpp"
+
+struct event_t
+{
+	lvldb::seq_t seq;
+	long         square;
+};
+
+// Blocking, so a lost wake up between processes would stall the test
+typedef lvldb::blocking_wait_t                                 wait_t;
+typedef lvldb::shared_disruptor_t<event_t>                     disruptor_t;
+typedef lvldb::shared_producer_t<event_t, wait_t>              producer_t;
+typedef lvldb::shared_consumer_t<event_t, wait_t>              consumer_t;
+
+// Local pipeline the consumer forwards to
+typedef lvldb::disruptor_t<event_t>                            local_disruptor_t;
+typedef lvldb::pipeline_t<local_disruptor_t, wait_t>           pipeline_t;
+typedef pipeline_t::fence_type                                 fence_t;
+typedef lvldb::publisher_t<pipeline_t::publisher_fence_type>   publisher_t;
+
+// Forwarded events keep their sequence since there is one publisher
+class checker_t: public lvldb::task_t<fence_t>
+{
+	public:
+
+	checker_t(fence_t &fence):
+		lvldb::task_t<fence_t>(fence, 16)
+	{ }
+
+	private:
+
+	void process_slot(event_t &event)
+	{
+		assert(event.seq == this->seq());
+		assert(event.square == static_cast<long>(event.seq * event.seq));
+		(void) event;
+	}
+};
+
+// Runs in its own process, opening the ring by name
+void produce(const char *name, lvldb::seq_t events)
+{
+	disruptor_t d(name);
+	producer_t  producer(d, wait_t(1000));
+
+	while (producer.seq() < events) {
+		size_t count = producer.acquire(std::min<lvldb::seq_t>(8, events - producer.seq()));
+
+		for (size_t i = 0; i < count; i++) {
+			lvldb::seq_t  seq   = producer.seq() + i;
+			event_t      &event = producer[seq];
+
+			event.seq    = seq;
+			event.square = seq * seq;
+		}
+
+		producer.publish();
+	}
+
+	producer.close();
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3) {
+		std::cerr << "Usage: " << argv[0] << " <disruptor size> <events>\n";
+
+		return EXIT_FAILURE;
+	}
+
+	std::string  name   = "/lvldb_shared_test." + std::to_string(getpid());
+	lvldb::seq_t events = std::stol(argv[2]);
+	disruptor_t  d(name.c_str(), std::stoi(argv[1]));
+	consumer_t   consumer(d, wait_t(1000));
+	pipeline_t   pipeline(std::stoi(argv[1]));
+	size_t       checker;
+	pid_t        pid;
+	int          status;
+
+	if ((pid = fork()) == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	// The child must not remove the name on its way out
+	if (pid == 0) {
+		produce(name.c_str(), events);
+		_exit(EXIT_SUCCESS);
+	}
+
+	// Started after the fork, the child gets no threads
+	pipeline.add_stage();
+	checker = pipeline.add_stage({0});
+	pipeline.add_task<checker_t>(checker);
+	pipeline.build();
+	pipeline.start();
+
+	publisher_t publisher(pipeline.publisher_fence());
+
+	while (size_t count = consumer.acquire(16)) {
+		for (size_t i = 0; i < count; i++) {
+			lvldb::seq_t  seq   = consumer.seq() + i;
+			event_t      &event = consumer[seq];
+
+			assert(event.seq == seq);
+			assert(event.square == static_cast<long>(seq * seq));
+			(void) event;
+		}
+
+		// Forwards the batch before releasing it
+		for (size_t i = 0; i < count; ) {
+			size_t forwarded = publisher.acquire(count - i);
+
+			for (size_t j = 0; j < forwarded; j++)
+				publisher[publisher.seq() + j] = consumer[consumer.seq() + i + j];
+
+			publisher.publish();
+			i += forwarded;
+		}
+
+		consumer.release();
+	}
+
+	pipeline.stop();
+
+	assert(consumer.seq() == events);
+	assert(pipeline.fence(checker).cursor() == events);
+
+	if (waitpid(pid, &status, 0) == -1) {
+		perror("waitpid");
+		exit(EXIT_FAILURE);
+	}
+
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+	std::cerr << "finished seq = " << consumer.seq() << std::endl;
+
+	return 0;
+}